@@ -23,6 +23,7 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <ifaddrs.h>
+#include <net/if.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -110,6 +111,39 @@ addr_equal(const struct sockaddr *sa1, const struct sockaddr *sa2)
 		return false;
 }
 
+/*
+ * Hash the network address (without the port) of an IPv4 or IPv6 socket
+ * address, consistent with addr_equal().
+ */
+uint32_t
+addr_hash(const struct sockaddr *sa)
+{
+	const unsigned char *p;
+	uint32_t hash = 2166136261U;
+	size_t len;
+
+	if (sa->sa_family == AF_INET) {
+		const struct sockaddr_in *sin =
+			(const struct sockaddr_in *)sa;
+
+		p = (const unsigned char *)&sin->sin_addr;
+		len = sizeof(sin->sin_addr);
+	} else if (sa->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *sin6 =
+			(const struct sockaddr_in6 *)sa;
+
+		p = (const unsigned char *)&sin6->sin6_addr;
+		len = sizeof(sin6->sin6_addr);
+	} else
+		return 0;
+
+	/* FNV-1a */
+	hash = (hash ^ sa->sa_family) * 16777619U;
+	while (len--)
+		hash = (hash ^ *p++) * 16777619U;
+	return hash;
+}
+
 bool
 is_local_addr(const struct addr *addr)
 {
@@ -126,3 +160,26 @@ is_local_addr(const struct addr *addr)
 	}
 	return false;
 }
+
+/*
+ * Return the index of the network interface with the given local address, or
+ * 0 if there is none.
+ */
+unsigned int
+addr_ifindex(const struct addr *addr)
+{
+	struct ifaddrs *ifa;
+	const struct ifaddrs *i;
+	unsigned int ifindex = 0;
+
+	if (getifaddrs(&ifa) == -1)
+		return 0;
+	for (i = ifa; i; i = i->ifa_next) {
+		if (i->ifa_addr && addr_equal(addr->sa, i->ifa_addr)) {
+			ifindex = if_nametoindex(i->ifa_name);
+			break;
+		}
+	}
+	freeifaddrs(ifa);
+	return ifindex;
+}
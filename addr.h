@@ -9,6 +9,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 struct addr {
 	int family;
@@ -20,6 +21,8 @@ struct addr {
 
 extern struct addr *find_addr(const char *name);
 extern bool addr_equal(const struct sockaddr *sa1, const struct sockaddr *sa2);
+extern uint32_t addr_hash(const struct sockaddr *sa);
 extern bool is_local_addr(const struct addr *addr);
+extern unsigned int addr_ifindex(const struct addr *addr);
 
 #endif  /* __ADDR_H */
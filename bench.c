@@ -0,0 +1,392 @@
+/*
+ * Copyright (C) 2026  FakeDLM contributors
+ *
+ * This file is part of FakeDLM.
+ *
+ * FakeDLM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * FakeDLM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FakeDLM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmarks for FakeDLM's event loop and lookup structures.  FakeDLM
+ * is included as a whole so that the benchmarks exercise the real (static)
+ * functions; nothing here talks to the kernel DLM.
+ *
+ * Usage: bench [benchmark ...]
+ */
+
+#define main fakedlm_main
+#include "fakedlm.c"
+#undef main
+
+#include <time.h>
+#include <sys/resource.h>
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Allow for as many file descriptors as the hard limit permits.
+ */
+static unsigned int
+raise_fd_limit(void)
+{
+	struct rlimit rlim;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == -1)
+		fail(NULL);
+	rlim.rlim_cur = rlim.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rlim) == -1)
+		fail(NULL);
+	return rlim.rlim_cur;
+}
+
+static void
+eventfd_ready(int fd, short revents, void *arg)
+{
+	uint64_t value;
+
+	if (read(fd, &value, sizeof(value)) != sizeof(value))
+		fail("eventfd");
+}
+
+/*
+ * Cost of one wakeup with a single ready file descriptor out of many, with
+ * epoll (add_poll_callback() and dispatch_poll_events()) and with a
+ * poll() array scanned for ready entries as before.
+ */
+static void
+bench_epoll(void)
+{
+	static const unsigned int counts[] = { 16, 64, 256, 1024, 4096, 16384 };
+	unsigned int max_fds = raise_fd_limit(), c;
+	const unsigned int iterations = 20000;
+
+	printf("%8s %16s %16s\n", "fds", "epoll ns/wakeup", "poll ns/wakeup");
+	for (c = 0; c < ARRAY_SIZE(counts); c++) {
+		unsigned int count = counts[c], n;
+		struct pollfd *pollfds;
+		uint64_t one = 1, start, t_epoll, t_poll;
+		int *fds;
+
+		if (count + 16 > max_fds)
+			break;
+		init_poll_callbacks(&cbs);
+		fds = calloc(count, sizeof(*fds));
+		pollfds = calloc(count, sizeof(*pollfds));
+		if (!fds || !pollfds)
+			fail(NULL);
+		for (n = 0; n < count; n++) {
+			fds[n] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (fds[n] == -1)
+				fail("eventfd");
+			add_poll_callback(&cbs, fds[n], POLLIN, eventfd_ready,
+					  NULL);
+			pollfds[n].fd = fds[n];
+			pollfds[n].events = POLLIN;
+		}
+
+		start = now_ns();
+		for (n = 0; n < iterations; n++) {
+			if (write(fds[n % count], &one, sizeof(one)) == -1)
+				fail("eventfd");
+			dispatch_poll_events(-1);
+		}
+		t_epoll = now_ns() - start;
+
+		start = now_ns();
+		for (n = 0; n < iterations; n++) {
+			unsigned int p;
+
+			if (write(fds[n % count], &one, sizeof(one)) == -1)
+				fail("eventfd");
+			if (poll(pollfds, count, -1) == -1)
+				fail(NULL);
+			for (p = 0; p < count; p++) {
+				if (pollfds[p].revents)
+					eventfd_ready(pollfds[p].fd,
+						      pollfds[p].revents, NULL);
+			}
+		}
+		t_poll = now_ns() - start;
+
+		printf("%8u %16llu %16llu\n", count,
+		       (unsigned long long)(t_epoll / iterations),
+		       (unsigned long long)(t_poll / iterations));
+		fflush(stdout);
+
+		for (n = 0; n < count; n++) {
+			remove_poll_callback(&cbs, fds[n]);
+			close(fds[n]);
+		}
+		free_removed_poll_callbacks(&cbs);
+		close(cbs.epoll_fd);
+		free(cbs.by_fd);
+		free(pollfds);
+		free(fds);
+	}
+}
+
+/*
+ * Cost of looking up a lockspace among many, by name and by global_id through
+ * the lockspace table, and by name by walking the lockspaces list as before.
+ */
+static void
+bench_lockspaces(void)
+{
+	static const unsigned int counts[] = { 10, 100, 1000, 10000 };
+	static struct node bench_node = { .nodeid = 1 };
+	char (*names)[DLM_LOCKSPACE_LEN + 1];
+	uint32_t *ids;
+	unsigned int c, count = 0;
+
+	local_node = &bench_node;
+	names = calloc(counts[ARRAY_SIZE(counts) - 1], sizeof(*names));
+	ids = calloc(counts[ARRAY_SIZE(counts) - 1], sizeof(*ids));
+	if (!names || !ids)
+		fail(NULL);
+
+	printf("%8s %16s %16s %16s\n", "spaces", "name ns/lookup",
+	       "id ns/lookup", "list ns/lookup");
+	for (c = 0; c < ARRAY_SIZE(counts); c++) {
+		unsigned int rounds = 1000000 / counts[c], n, r;
+		unsigned int list_rounds = rounds / counts[c] + 1;
+		uint64_t start, t_name, t_id, t_list;
+		unsigned long found = 0;
+
+		for (; count < counts[c]; count++) {
+			struct lockspace *ls;
+
+			snprintf(names[count], sizeof(names[count]),
+				 "lockspace-%u", count);
+			ls = new_lockspace(names[count]);
+			ids[count] = ls->global_id;
+		}
+
+		start = now_ns();
+		for (r = 0; r < rounds; r++) {
+			for (n = 0; n < count; n++)
+				found += !!find_lockspace(names[n]);
+		}
+		t_name = now_ns() - start;
+
+		start = now_ns();
+		for (r = 0; r < rounds; r++) {
+			for (n = 0; n < count; n++)
+				found += !!find_lockspace_by_id(ids[n]);
+		}
+		t_id = now_ns() - start;
+
+		start = now_ns();
+		for (r = 0; r < list_rounds; r++) {
+			for (n = 0; n < count; n++) {
+				struct lockspace *ls;
+
+				for (ls = lockspaces; ls; ls = ls->next) {
+					if (strcmp(names[n], ls->name) == 0)
+						break;
+				}
+				found += !!ls;
+			}
+		}
+		t_list = now_ns() - start;
+
+		if (found != (2UL * rounds + list_rounds) * count) {
+			fprintf(stderr, "Lockspace lookups failed\n");
+			exit(1);
+		}
+		printf("%8u %16llu %16llu %16llu\n", count,
+		       (unsigned long long)(t_name / rounds / count),
+		       (unsigned long long)(t_id / rounds / count),
+		       (unsigned long long)(t_list / list_rounds / count));
+		fflush(stdout);
+	}
+	free(ids);
+	free(names);
+}
+
+/*
+ * Free the nodes created by parse_nodes().
+ */
+static void
+free_nodes(void)
+{
+	while (nodes) {
+		struct node *node = nodes;
+
+		nodes = node->next;
+		free(node->addr);
+		free(node->name);
+		free(node);
+	}
+	free(node_table.slots);
+	memset(&node_table, 0, sizeof(node_table));
+	memset(nodes_by_id, 0, sizeof(nodes_by_id));
+	local_node = NULL;
+}
+
+/*
+ * Cost of finding the node behind an incoming connection.  All other nodes
+ * connect at once, each from its own loopback address.  Once all the
+ * connections have been accepted, their peer addresses are looked up through
+ * the node table (tcp_peer_node()) and by walking the nodes list as before.
+ */
+static void
+bench_peers(void)
+{
+	static const unsigned int counts[] = { 16, 64, 256, 1024 };
+	unsigned int max_fds = raise_fd_limit(), c;
+
+	local_nodeid = 1;
+	printf("%8s %16s %16s %16s\n", "nodes", "accept ns/conn",
+	       "table ns/lookup", "list ns/lookup");
+	for (c = 0; c < ARRAY_SIZE(counts); c++) {
+		unsigned int count = counts[c], rounds = 1000000 / count;
+		unsigned int list_rounds = rounds / count + 1, n, r;
+		struct sockaddr_storage *peers, ss;
+		socklen_t sa_len = sizeof(ss);
+		uint64_t start, t_accept, t_table, t_list;
+		unsigned long found = 0;
+		char **names;
+		int listen_fd, *fds;
+
+		if (count > MAX_NODES || 2 * count + 16 > max_fds)
+			break;
+		names = calloc(count, sizeof(*names));
+		fds = calloc(2 * count, sizeof(*fds));
+		peers = calloc(count, sizeof(*peers));
+		if (!names || !fds || !peers)
+			fail(NULL);
+		for (n = 0; n < count; n++) {
+			if (asprintf(&names[n], "127.1.%u.%u",
+				     (n + 1) / 250, (n + 1) % 250 + 1) == -1)
+				fail(NULL);
+		}
+		parse_nodes(names, count);
+
+		listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK |
+					    SOCK_CLOEXEC, 0);
+		if (listen_fd == -1 ||
+		    bind(listen_fd, local_node->addr->sa,
+			 local_node->addr->sa_len) == -1 ||
+		    listen(listen_fd, count) == -1 ||
+		    getsockname(listen_fd, (struct sockaddr *)&ss,
+				&sa_len) == -1)
+			fail(NULL);
+		for (n = 1; n < count; n++) {
+			struct node *node = nodes_by_id[n + 1];
+
+			fds[n] = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			if (fds[n] == -1 ||
+			    bind(fds[n], node->addr->sa,
+				 node->addr->sa_len) == -1 ||
+			    connect(fds[n], (struct sockaddr *)&ss,
+				    sa_len) == -1)
+				fail(node->name);
+		}
+
+		start = now_ns();
+		for (n = 1; n < count; n++) {
+			sa_len = sizeof(peers[n]);
+			fds[count + n] = accept4(listen_fd,
+						 (struct sockaddr *)&peers[n],
+						 &sa_len, SOCK_NONBLOCK);
+			if (fds[count + n] == -1)
+				fail(NULL);
+		}
+		t_accept = now_ns() - start;
+
+		start = now_ns();
+		for (r = 0; r < rounds; r++) {
+			for (n = 1; n < count; n++) {
+				struct sockaddr *sa =
+					(struct sockaddr *)&peers[n];
+
+				found += !!tcp_peer_node(sa, sizeof(peers[n]));
+			}
+		}
+		t_table = now_ns() - start;
+
+		start = now_ns();
+		for (r = 0; r < list_rounds; r++) {
+			for (n = 1; n < count; n++) {
+				struct sockaddr *sa =
+					(struct sockaddr *)&peers[n];
+				struct node *node;
+
+				for (node = nodes; node; node = node->next) {
+					if (addr_equal(sa, node->addr->sa))
+						break;
+				}
+				found += !!node;
+			}
+		}
+		t_list = now_ns() - start;
+
+		if (found != (unsigned long)(rounds + list_rounds) * (count - 1)) {
+			fprintf(stderr, "Peer lookups failed\n");
+			exit(1);
+		}
+		printf("%8u %16llu %16llu %16llu\n", count,
+		       (unsigned long long)(t_accept / (count - 1)),
+		       (unsigned long long)(t_table / rounds / (count - 1)),
+		       (unsigned long long)(t_list / list_rounds / (count - 1)));
+		fflush(stdout);
+
+		for (n = 1; n < count; n++) {
+			close(fds[n]);
+			close(fds[count + n]);
+		}
+		close(listen_fd);
+		free_nodes();
+		for (n = 0; n < count; n++)
+			free(names[n]);
+		free(peers);
+		free(fds);
+		free(names);
+	}
+}
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} benchmarks[] = {
+	{ "epoll", bench_epoll },
+	{ "lockspaces", bench_lockspaces },
+	{ "peers", bench_peers },
+};
+
+int main(int argc, char *argv[])
+{
+	unsigned int b;
+	int n;
+
+	for (b = 0; b < ARRAY_SIZE(benchmarks); b++) {
+		bool run = argc == 1;
+
+		for (n = 1; n < argc; n++)
+			run |= strcmp(argv[n], benchmarks[b].name) == 0;
+		if (!run)
+			continue;
+		printf("== %s\n", benchmarks[b].name);
+		fflush(stdout);
+		benchmarks[b].run();
+	}
+	return 0;
+}
@@ -22,6 +22,8 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -176,3 +178,129 @@ printf_pathf(const char *value_format, const char *path_format, ...)
 	va_end(ap);
 }
 
+/*
+ * The *atf() functions below take paths relative to a directory file
+ * descriptor (which can be an O_PATH descriptor).  They format the path into
+ * a buffer on the stack and don't allocate any memory.  Error messages
+ * include the directory, as found in /proc/self/fd.
+ */
+
+static void __attribute__((noreturn))
+fail_at(int dirfd, const char *path)
+{
+	char link[32], dir[PATH_MAX];
+	int saved_errno = errno;
+	ssize_t len;
+
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", dirfd);
+	len = readlink(link, dir, sizeof(dir) - 1);
+	errno = saved_errno;
+	if (len == -1)
+		fail(path);
+	dir[len] = 0;
+	failf("%s/%s", dir, path);
+}
+
+static void
+vformat_path(char *path, const char *fmt, va_list ap)
+{
+	int len;
+
+	len = vsnprintf(path, PATH_MAX, fmt, ap);
+	if (len < 0)
+		fail(NULL);
+	if (len >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		fail(path);
+	}
+}
+
+void
+mkdiratf(int dirfd, mode_t mode, const char *fmt, ...)
+{
+	char path[PATH_MAX];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vformat_path(path, fmt, ap);
+	va_end(ap);
+	if (mkdirat(dirfd, path, mode) == -1)
+		fail_at(dirfd, path);
+}
+
+void
+rmdiratf(int dirfd, const char *fmt, ...)
+{
+	char path[PATH_MAX];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vformat_path(path, fmt, ap);
+	va_end(ap);
+	if (unlinkat(dirfd, path, AT_REMOVEDIR) == -1)
+		fail_at(dirfd, path);
+}
+
+int
+openatf(int dirfd, int flags, const char *fmt, ...)
+{
+	char path[PATH_MAX];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vformat_path(path, fmt, ap);
+	va_end(ap);
+	return openat(dirfd, path, flags);
+}
+
+static void
+write_at(int dirfd, const void *value, int len, const char *path)
+{
+	int fd;
+
+	fd = openat(dirfd, path, O_WRONLY);
+	if (fd == -1 ||
+	    write(fd, value, len) == -1 ||
+	    close(fd) == -1)
+		fail_at(dirfd, path);
+}
+
+void
+write_atf(int dirfd, const void *value, int len, const char *path_format, ...)
+{
+	char path[PATH_MAX];
+	va_list ap;
+
+	va_start(ap, path_format);
+	vformat_path(path, path_format, ap);
+	va_end(ap);
+	write_at(dirfd, value, len, path);
+}
+
+void
+write_uint_atf(int dirfd, unsigned int value, const char *path_format, ...)
+{
+	char path[PATH_MAX], buf[16];
+	va_list ap;
+	int len;
+
+	va_start(ap, path_format);
+	vformat_path(path, path_format, ap);
+	va_end(ap);
+	len = snprintf(buf, sizeof(buf), "%u", value);
+	write_at(dirfd, buf, len, path);
+}
+
+void
+write_int_atf(int dirfd, int value, const char *path_format, ...)
+{
+	char path[PATH_MAX], buf[16];
+	va_list ap;
+	int len;
+
+	va_start(ap, path_format);
+	vformat_path(path, path_format, ap);
+	va_end(ap);
+	len = snprintf(buf, sizeof(buf), "%d", value);
+	write_at(dirfd, buf, len, path);
+}
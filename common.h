@@ -30,6 +30,12 @@ extern int __attribute__((format(printf, 2, 3))) open_pathf(int flags, const cha
 extern void vwrite_pathf(void *value, int len, const char *path_format, va_list ap);
 extern void write_pathf(void *value, int len, const char *path_format, ...);
 extern void printf_pathf(const char *value_format, const char *path_format, ...);
+extern void __attribute__((format(printf, 3, 4))) mkdiratf(int dirfd, mode_t mode, const char *fmt, ...);
+extern void __attribute__((format(printf, 2, 3))) rmdiratf(int dirfd, const char *fmt, ...);
+extern int __attribute__((format(printf, 3, 4))) openatf(int dirfd, int flags, const char *fmt, ...);
+extern void __attribute__((format(printf, 4, 5))) write_atf(int dirfd, const void *value, int len, const char *path_format, ...);
+extern void __attribute__((format(printf, 3, 4))) write_uint_atf(int dirfd, unsigned int value, const char *path_format, ...);
+extern void __attribute__((format(printf, 3, 4))) write_int_atf(int dirfd, int value, const char *path_format, ...);
 
 extern bool verbose;
 extern bool debug;
@@ -33,10 +33,10 @@
  * MSG_CLOSE
  *   Each node creates listening sockets for its peers to connect to and tries
  *   to connect to each of its peers.  Once an incoming or outgoing connection
- *   is accepted, node->outgoing_fd is set to that connection.  If the node
+ *   is accepted, node->outgoing is set to that connection.  If the node
  *   with the lower node ID notices that it has two connections to the same
  *   peer (an accepted incoming and a connected otgoing connection), it sends a
- *   MSG_CLOSE message on one of these connections and sets node->outgoing_fd
+ *   MSG_CLOSE message on one of these connections and sets node->outgoing
  *   to the other connection.  All nodes close connections on which they
  *   receive MSG_CLOSE messages.
  *
@@ -49,16 +49,111 @@
  *   A lockspace has been stopped on the sending node.  The receiving node must
  *   follow up with either MSG_JOIN_LOCKSPACE or MSG_LEAVE_LOCKSPACE.
  *
+ * MSG_MEMBER_STOPPED [lockspace_name],
+ * MSG_LOCKSPACE_UNUSED [lockspace_name]:
+ *   Replies to MSG_STOP_LOCKSPACE in scoped rounds (CAP_SCOPED): the sending
+ *   node is a lockspace member and has stopped the lockspace, or it neither
+ *   is a member nor trying to become one and has nothing to stop.  A
+ *   MSG_LOCKSPACE_STOPPED reply comes from a node that has started a round
+ *   of its own, which will also include the receiving node.
+ *
  * MSG_JOIN_LOCKSPACE [lockspace_name],
  * MSG_LEAVE_LOCKSPACE [lockspace_name]:
  *   Request to join or leave a lockspace.  The lockspace must have been
  *   stopped with MSG_STOP_LOCKSPACE first.  The receiving node must restart
  *   the lockspace once there are no more pending "locks" on the lockspace by
- *   other nodes.
+ *   other nodes.  The sending node waits in the same way, so overlapping
+ *   rounds are applied together with a single restart.
+ *
+ * MSG_RESTART_LOCKSPACE [lockspace_name]:
+ *   Like MSG_JOIN_LOCKSPACE and MSG_LEAVE_LOCKSPACE, but the sending node's
+ *   own membership doesn't change; only the membership changes the receiving
+ *   node already knows about are applied.  Used for evicting failed nodes.
+ *
+ * MSG_JOIN_REQUEST [lockspace_name],
+ * MSG_LEAVE_REQUEST [lockspace_name]:
+ *   With --coordinated, request to join or leave a lockspace on behalf of the
+ *   sending node.  Sent to the lockspace's coordinator instead of starting a
+ *   round.
+ *
+ * MSG_MEMBERSHIP [lockspace_name, members, joining, leaving]:
+ *   Sent by a coordinator at the end of its round: the membership changes to
+ *   apply.  Like MSG_RESTART_LOCKSPACE, this releases the "lock" taken by the
+ *   coordinator's MSG_STOP_LOCKSPACE.
+ *
+ * MSG_NODE_FAILED [node ID]:
+ *   The sending node has lost its connection to the given node.
+ *
+ * MSG_DEPART:
+ *   The sending node is shutting down.  It will leave all lockspaces and
+ *   then disconnect; the receiving node then removes it from the cluster
+ *   until it reconnects instead of treating it as failed.
+ *
+ * MSG_DIGEST, MSG_DIGEST_END:
+ *   Sent by each side of a new connection: the lockspaces the sending node is
+ *   a member of, along with their members as seen by the sending node.  Each
+ *   node is authoritative for its own membership, so the receiving node
+ *   compares the digest with its own view and fixes the sending node's
+ *   membership in the lockspaces that differ.  Membership changes missed
+ *   while the nodes were disconnected are reconciled this way without
+ *   restarting any other lockspaces.
+ *
+ * Rounds are scoped to the nodes using a lockspace when all peers support
+ * CAP_SCOPED: leave and eviction rounds only go to the lockspace members and
+ * to the nodes with rounds of their own in progress.  A node that joins a
+ * lockspace cannot know who is using it, so it still sends
+ * MSG_STOP_LOCKSPACE to all peers, but only the members have to stop
+ * anything, and the other nodes answer with MSG_LOCKSPACE_UNUSED without
+ * keeping any state for the lockspace.  The joining node learns the members
+ * from their MSG_MEMBER_STOPPED replies.  Rounds are not scoped with --tree
+ * or --multicast.
+ *
+ * With --coordinated, nodes don't run rounds of their own.  Each lockspace
+ * has a coordinator that all nodes agree on, chosen by hashing the lockspace's
+ * global_id over the connected nodes.  Nodes send MSG_JOIN_REQUEST and
+ * MSG_LEAVE_REQUEST to the coordinator, which collects the requests that
+ * arrive while its round is in progress, stops the lockspace once, and ends
+ * the round with MSG_MEMBERSHIP.  When several nodes join or leave at the
+ * same time, this costs one round instead of one round per node, and the
+ * work of coordinating is spread over all nodes.  If a coordinator goes away,
+ * the pending requests are sent to the new one.
  *
  * When a node loses connectivity to any of its peers (but not when it closes a
  * connection in response to a MSG_CLOSE * requests), it leaves all lockspaces
- * and waits for full connectivity to be re-established.
+ * and waits for full connectivity to be re-established.  With --evict, the
+ * surviving nodes instead remove the failed node from all lockspaces and
+ * restart them in place, as long as they still form a majority of the nodes
+ * given on the command line (departed nodes included): each of them
+ * reports the failure to the others with MSG_NODE_FAILED, and the connected
+ * member with the lowest node ID stops each affected lockspace and then sends
+ * MSG_RESTART_LOCKSPACE.
+ *
+ * Messages are sent in the original fixed-size format (struct proto_msg) until
+ * both sides of a connection have agreed on something better: each side
+ * starts by sending a HELLO with its protocol version and capabilities, and
+ * answers the peer's HELLO with a HELLO_ACK.  Everything sent after the
+ * HELLO_ACK uses the common version.  Both are disguised as
+ * MSG_LOCKSPACE_STOPPED messages for the empty lockspace name, which older
+ * versions ignore.
+ *
+ * In version 2, messages have a short header (struct proto_hdr) and refer to
+ * lockspaces by global_id.  The lockspace name is only appended the first
+ * time a lockspace is mentioned to a peer.  With CAP_BATCH, consecutive
+ * messages of the same type queued during the same event loop iteration are
+ * combined into a single message carrying a vector of global_ids.  Each
+ * lockspace still goes through its own round, and lockspace_stopped() and
+ * update_lockspace() still run per lockspace, as the kernel is configured
+ * per lockspace anyway.  But the rounds of lockspaces that change in the
+ * same iteration proceed in lockstep, so mass joins and leaves cost a few
+ * messages and round trips per round instead of per lockspace.
+ *
+ * With --tree, the node that starts a round sends MSG_STOP_LOCKSPACE,
+ * MSG_JOIN_LOCKSPACE, and MSG_LEAVE_LOCKSPACE only to its children in a
+ * spanning tree rooted at itself, and the other nodes forward them to their
+ * own children (MSG_F_RELAY).  The MSG_LOCKSPACE_STOPPED replies travel back
+ * up the tree: each node waits for its subtree and then replies with the set
+ * of nodes that have stopped.  This way, each node only handles a few
+ * messages per round no matter how large the cluster is.
  */
 
 #define _GNU_SOURCE
@@ -69,6 +164,10 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <endian.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <ifaddrs.h>
 #include <fcntl.h>
@@ -76,10 +175,13 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <string.h>
 #include <signal.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <aio.h>
 #include <getopt.h>
 #include <assert.h>
@@ -89,6 +191,11 @@
 #include "modprobe.h"
 #include "crc.h"
 #include "list.h"
+#include "nodemask.h"
+#include "mpsc.h"
+#include "uring.h"
+#include "timer.h"
+#include "pool.h"
 
 #define DLM_SYSFS_DIR "/sys/kernel/dlm"
 #define MISC_PREFIX "/dev/misc/"
@@ -105,9 +212,57 @@
 
 #define MAX_LINE_UEVENT 256
 
-typedef uint32_t node_mask_t;
+/*
+ * Lost and failed connections to peers are retried with exponential backoff
+ * between RECONNECT_MIN_MS and RECONNECT_MAX_MS, with random jitter so that
+ * restarting nodes don't all retry in lockstep.  Connection attempts that
+ * take longer than CONNECT_TIMEOUT_MS are started over.  Once a peer is
+ * reachable again, it is reconnected to within about RECONNECT_MAX_MS.
+ */
+#define RECONNECT_MIN_MS 100
+#define RECONNECT_MAX_MS 5000
+#define CONNECT_TIMEOUT_MS 5000
+
+/*
+ * Outgoing messages are queued per connection and written out once per event
+ * loop iteration.  A peer that lets more than MAX_SEND_QUEUE bytes pile up is
+ * considered dead.
+ */
+#define MIN_SEND_QUEUE 1024
+#define MAX_SEND_QUEUE (1 << 20)
+
+/*
+ * Peers are declared dead when nothing has been heard from them for
+ * failure_timeout milliseconds (--failure-timeout).  Peers that support
+ * CAP_HEARTBEAT are sent HEARTBEATS_PER_TIMEOUT heartbeats per timeout period,
+ * so an idle peer will still be heard from.  For other peers, we rely on TCP
+ * keepalives and TCP_USER_TIMEOUT, which are derived from the same timeout.
+ */
+#define DEFAULT_FAILURE_TIMEOUT_MS 10000
+#define HEARTBEATS_PER_TIMEOUT 4
+
+/*
+ * Optional multicast channel for messages to all peers (--multicast).  Each
+ * packet carries version 2 messages and a per-sender sequence number.
+ * Receivers notice lost packets by gaps in the sequence numbers and ask the
+ * sender to retransmit them over TCP (MSG_MCAST_NACK).  Senders announce
+ * their next sequence number (MSG_MCAST_SEQ) along with each heartbeat and
+ * MCAST_ANNOUNCE_MS after the last packet, so a lost final packet is noticed
+ * as well.  The last MCAST_HISTORY packets are kept for retransmission.
+ *
+ * Messages sent over TCP could overtake earlier multicast packets.  So before
+ * anything else is sent to a peer over TCP, the sender announces its next
+ * sequence number, and the peer holds back what follows the announcement
+ * until it has received all the multicast packets before.
+ */
+#define MCAST_MTU 1400
+#define MCAST_HISTORY 256
+#define MCAST_ANNOUNCE_MS 10
+
+/* Maximum number of lockspaces in a batched message. */
+#define MAX_BATCH 256
 
-#define MAX_NODES (sizeof(node_mask_t) * 8)
+#define RECV_BUFFER_SIZE 65536
 
 #define LISTENING_SOCKET_MARKER ((void *)1)
 
@@ -115,29 +270,102 @@ struct node {
 	char *name;
 	int nodeid;
 	struct addr *addr;
-	int outgoing_fd;
+	struct connection *outgoing;
+	struct list_head connections;
 	int connecting_fd;
+	struct timer reconnect_timer;
+	int connect_attempts;
+	struct timer heartbeat_timer;
+	uint64_t last_heard;  /* now_ms() of the last data received */
+	unsigned int rtt, srtt;  /* last and smoothed round-trip time, in us */
+	bool mcast_synced;  /* mcast_expected is valid */
+	bool mcast_nacked;  /* retransmission of mcast_expected requested */
+	uint32_t mcast_expected;  /* next multicast sequence number */
+	bool mcast_holding;  /* holding back messages until mcast_hold */
+	uint32_t mcast_hold;
+	char *mcast_held;  /* messages held back */
+	unsigned int mcast_held_len, mcast_held_size;
 	bool nodir;
 	int weight;
 	struct node *next;
 };
 
+/*
+ * Open addressing hash table of all nodes, keyed by the hash of their
+ * network address.
+ */
+struct node_table {
+	struct node **slots;
+	unsigned int mask;
+};
+
 struct lockspace {
-	char *name;
-	uint32_t global_id;
+	char name[DLM_LOCKSPACE_LEN + 1];
+	uint32_t global_id;  /* also the lockspace table hash key */
 	short minor;
 	int control_fd;
+	int config_fd;  /* O_PATH fd of spaces/<name> in configfs, or -1 */
 	node_mask_t members;
 	node_mask_t stopping;
 	node_mask_t stopped;
 	node_mask_t joining;
 	node_mask_t leaving;
+	node_mask_t name_sent;  /* nodes that know the global_id */
+	node_mask_t round;  /* peers our own round has been sent to */
+	struct list_head tree_rounds;
+	bool evicting;  /* we are running an eviction round */
+	bool coordinating;  /* we are running a round for others (--coordinated) */
+	int coordinator;  /* node ID our own change was requested from, or 0 */
+	bool announced;  /* our own MSG_JOIN_LOCKSPACE / MSG_LEAVE_LOCKSPACE sent */
+	unsigned int epoch;  /* number of membership updates applied */
+	node_mask_t digest_seen;  /* listed in the digest being received */
 	struct lockspace *next;
 };
 
+/*
+ * A round relayed along a spanning tree (--tree) for which we are still
+ * collecting MSG_LOCKSPACE_STOPPED replies from our subtree.
+ */
+struct tree_round {
+	struct list_head list;
+	struct node *origin;  /* the root of the tree */
+	int fanout;
+	node_mask_t nodes;  /* the nodes in the tree */
+	node_mask_t subtree;  /* the nodes in our subtree, including us */
+	node_mask_t stopped;
+};
+
+/*
+ * Open addressing hash table of all lockspaces, keyed by global_id.  Different
+ * lockspace names can map to the same global_id, so lookups by name still
+ * compare the names.
+ */
+struct lockspace_table {
+	struct lockspace **slots;
+	unsigned int bits;
+	unsigned int num;
+};
+
+/*
+ * An asynchronous write, submitted through io_uring when the kernel supports
+ * it and through POSIX aio otherwise.  Once the write has completed, error is
+ * set to 0 or an error number and the complete callback is called from the
+ * event loop.
+ *
+ * POSIX aio completions are reported on a separate thread, and are passed to
+ * the event loop through the aio_notified queue.
+ */
 struct aio_request {
 	struct list_head list;
-	struct aiocb aiocb;
+	struct mpsc_node notified;
+	int fd;
+	const void *buf;
+	size_t nbytes;
+	int error;
+	union {
+		struct aiocb aiocb;
+		struct iovec iov;
+	};
 	void (*complete)(struct aio_request *);
 };
 
@@ -146,23 +374,110 @@ struct lockspace_aio_request {
 	struct lockspace *ls;
 };
 
+/*
+ * A DLM_USER_REMOVE_LOCKSPACE request along with the buffer it writes.
+ */
+struct release_request {
+	struct aio_request aio_req;
+	struct dlm_write_request req;
+};
+
+/*
+ * How peer nodes connect to each other: over TCP to the nodes' network
+ * addresses, or over AF_UNIX stream sockets in a common directory (for
+ * running multiple simulated nodes on the same host).
+ *
+ * connect() creates a non-blocking socket in *fd and returns the result of
+ * connecting it.  peer_node() determines which node an accepted connection
+ * comes from.  cleanup() removes what the transport has left behind in the
+ * file system, if anything.
+ */
+struct transport {
+	void (*listen)(void);
+	int (*connect)(struct node *node, int *fd);
+	struct node *(*peer_node)(struct sockaddr *sa, socklen_t sa_len);
+	void (*cleanup)(void);
+};
+
+/*
+ * An established connection to a peer node.  Messages are only sent on the
+ * node's outgoing connection, but there can be additional connections
+ * in the process of being closed.  Queued output is kept in a ring buffer
+ * with free-running head and tail offsets; connections with queued output are
+ * on the flush_connections list.
+ */
+struct connection {
+	int fd;
+	struct node *node;
+	struct list_head list;
+	struct list_head flush_list;
+	char *out_buf;
+	unsigned int out_size;  /* power of two, or 0 */
+	unsigned int out_head, out_tail;
+	char *in_buf;  /* RECV_BUFFER_SIZE bytes */
+	unsigned int in_len;
+	uint32_t caps;  /* common capabilities */
+	bool send_v2, recv_v2;
+	uint8_t batch_type;  /* of the batched global_ids */
+	unsigned int batch_len;
+	uint32_t batch[MAX_BATCH];  /* network byte order */
+	uint32_t mcast_announced;  /* last MSG_MCAST_SEQ sent */
+};
+
+/*
+ * The event mask values passed to and from the poll callbacks are the POLL*
+ * constants, which are identical to their EPOLL* counterparts.  The epoll
+ * events point directly at their struct poll_callback.
+ */
 struct poll_callback {
+	int fd;
+	short events;
 	void (*callback)(int, short, void *);
 	void *arg;
+	struct list_head list;
+};
+
+struct udev_device {
+	struct timer timer;
+	const char *path;
+	int flags;
+	int step, timeout;  /* in milliseconds */
+	void (*opened)(struct udev_device *, int);
 };
 
 struct poll_callbacks {
-	struct pollfd *pollfds;
-	struct poll_callback *callbacks;
-	int num;
+	int epoll_fd;
+	struct poll_callback **by_fd;
+	int size;
+	struct list_head active;
+	struct list_head removed;
 };
 
+#define MAX_EPOLL_EVENTS 64
+
+#define URING_ENTRIES 256
+
 enum msg_type {
 	MSG_CLOSE = 1,
 	MSG_STOP_LOCKSPACE,
 	MSG_LOCKSPACE_STOPPED,
 	MSG_JOIN_LOCKSPACE,
 	MSG_LEAVE_LOCKSPACE,
+	MSG_HEARTBEAT,
+	MSG_HEARTBEAT_ACK,
+	MSG_MCAST_SEQ,
+	MSG_MCAST_NACK,
+	MSG_MCAST_DATA,
+	MSG_NODE_FAILED,
+	MSG_RESTART_LOCKSPACE,
+	MSG_DEPART,
+	MSG_DIGEST,
+	MSG_DIGEST_END,
+	MSG_MEMBER_STOPPED,
+	MSG_LOCKSPACE_UNUSED,
+	MSG_JOIN_REQUEST,
+	MSG_LEAVE_REQUEST,
+	MSG_MEMBERSHIP,
 };
 
 struct proto_msg {
@@ -170,25 +485,193 @@ struct proto_msg {
 	char lockspace_name[DLM_LOCKSPACE_LEN];
 };
 
+#define PROTO_VERSION 2
+
+/* Capabilities */
+#define CAP_GLOBAL_ID 1  /* version 2 messages */
+#define CAP_BATCH 2  /* MSG_F_BATCH */
+#define CAP_HEARTBEAT 4  /* MSG_HEARTBEAT, MSG_HEARTBEAT_ACK */
+#define CAP_MULTICAST 8  /* multicast channel, MSG_MCAST_* */
+#define CAP_RELAY 16  /* MSG_F_RELAY */
+#define CAP_EVICT 32  /* --evict, MSG_NODE_FAILED, MSG_RESTART_LOCKSPACE */
+#define CAP_DEPART 64  /* MSG_DEPART */
+#define CAP_DIGEST 128  /* MSG_DIGEST, MSG_DIGEST_END */
+#define CAP_SCOPED 256  /* MSG_MEMBER_STOPPED, MSG_LOCKSPACE_UNUSED */
+#define CAP_COORD 512  /* --coordinated, MSG_*_REQUEST, MSG_MEMBERSHIP */
+
+#define PROTO_CAPS (CAP_GLOBAL_ID | CAP_BATCH | CAP_HEARTBEAT | CAP_RELAY | \
+		    CAP_DEPART | CAP_DIGEST)
+
+enum hello_type {
+	HELLO = 1,
+	HELLO_ACK,
+};
+
+/*
+ * Version handshake, in the lockspace_name field of a MSG_LOCKSPACE_STOPPED
+ * message.
+ */
+struct proto_hello {
+	char empty;  /* empty lockspace name */
+	char magic[3];  /* HELLO_MAGIC */
+	uint8_t type;
+	uint8_t version;
+	uint16_t reserved;
+	uint32_t caps;
+} __attribute__((packed));
+
+#define HELLO_MAGIC "FDL"
+
+/*
+ * Version 2 message header.  When MSG_F_NAME is set, the message is followed
+ * by the lockspace name (not NUL terminated).  When MSG_F_BATCH is set, the
+ * message is followed by the global_ids of further lockspaces the message
+ * applies to.
+ */
+struct proto_hdr {
+	uint16_t len;  /* including the header */
+	uint8_t msg;
+	uint8_t flags;
+	uint32_t global_id;
+} __attribute__((packed));
+
+#define MSG_F_NAME 1
+#define MSG_F_BATCH 2
+#define MSG_F_RELAY 4
+
+/*
+ * Follows the header of messages relayed along a spanning tree (MSG_F_RELAY),
+ * before the lockspace name.  The tree is defined by its root, its fanout,
+ * and the set of nodes in it, which follows as mask_words 64-bit words.  In
+ * MSG_LOCKSPACE_STOPPED replies, this is followed by the set of nodes that
+ * have stopped the lockspace, again as mask_words 64-bit words.
+ */
+struct proto_relay {
+	uint16_t origin;
+	uint8_t fanout;
+	uint8_t mask_words;
+} __attribute__((packed));
+
+/*
+ * MSG_DIGEST messages carry a sequence of lockspace entries, each followed by
+ * the lockspace members as mask_words 64-bit words and by the lockspace name
+ * when name_len is not 0.
+ */
+struct proto_digest {
+	uint32_t global_id;
+	uint8_t mask_words;
+	uint8_t name_len;
+	uint16_t reserved;
+} __attribute__((packed));
+
+/* Maximum length of a MSG_DIGEST message. */
+#define MAX_DIGEST_LEN 16384
+
+/*
+ * Follows the header of MSG_MEMBERSHIP messages: the lockspace members and
+ * the joining and leaving nodes, each as mask_words 64-bit words, followed by
+ * the lockspace name.
+ */
+struct proto_membership {
+	uint8_t mask_words;
+	uint8_t reserved[3];
+} __attribute__((packed));
+
+/* A MSG_MEMBERSHIP message, decoded. */
+struct membership {
+	node_mask_t members;
+	node_mask_t joining;
+	node_mask_t leaving;
+};
+
+/* A relayed message, decoded. */
+struct relay {
+	struct node *origin;
+	int fanout;
+	node_mask_t nodes;
+	node_mask_t stopped;
+};
+
+/*
+ * Multicast packet header.  The packet data is a sequence of version 2
+ * messages.  Retransmitted packets are sent over TCP as MSG_MCAST_DATA
+ * messages with the sequence number in the global_id field.
+ */
+struct mcast_hdr {
+	uint16_t nodeid;
+	uint16_t reserved;
+	uint32_t seq;
+} __attribute__((packed));
+
+struct mcast_packet {
+	uint32_t seq;
+	unsigned int len;
+	unsigned int last;  /* offset of the last message */
+	char data[MCAST_MTU - sizeof(struct mcast_hdr)];
+};
+
 bool verbose;
 bool debug;
 
 static const char *progname;
+static const struct transport *transport;
+static const char *unix_dir;
+static bool simulate;  /* --simulate: no kernel DLM */
+static int local_nodeid;
+static const char *mcast_group;
+static int mcast_fd = -1;
+static struct sockaddr_storage mcast_addr;
+static socklen_t mcast_addr_len;
+static uint32_t mcast_seq;  /* of the packet being assembled */
+static struct mcast_packet *mcast_history;
+static struct timer mcast_announce_timer;
+static int tree_fanout;  /* --tree, or 0 */
+static bool evict_failed;  /* --evict */
+static bool coordinated;  /* --coordinated */
 static char *cluster_name;
 static int fakedlm_port = FAKEDLM_PORT;
 static int dlm_port = DLM_PORT;
 static enum { PROTO_TCP, PROTO_SCTP } dlm_protocol;
 static int kernel_monitor_fd = -1;
 static int control_fd = -1;
+
+/*
+ * O_PATH file descriptors of the DLM directories in sysfs and configfs, so
+ * that attributes can be accessed by short relative paths.
+ */
+static int dlm_sysfs_fd = -1;
+static int comms_fd = -1;
+static int spaces_fd = -1;
 static struct lockspace *lockspaces;
+static struct lockspace_table lockspace_table;
+static struct lockspace **minor_lockspaces;
+static int minor_lockspaces_size;
 static int joined_lockspaces;
 static struct node *nodes, *local_node;
+static struct node *nodes_by_id[MAX_NODES + 1];
+static struct node_table node_table;
 static node_mask_t all_nodes;
+static node_mask_t cluster_nodes;  /* all_nodes before any departures */
 static node_mask_t connected_nodes;
+static node_mask_t departing_nodes;  /* have sent MSG_DEPART */
 static int shut_down;
+static unsigned int failure_timeout = DEFAULT_FAILURE_TIMEOUT_MS;
+static int dump_status;
 struct poll_callbacks cbs;
 static LIST_HEAD(aio_pending);
 LIST_HEAD(aio_completed);
+static struct uring ring = { .fd = -1 };
+static struct mpsc_queue aio_notified = MPSC_QUEUE_INIT;
+static int aio_notify_fd = -1;
+static LIST_HEAD(flush_connections);
+static struct pool lockspace_pool =
+	POOL_INIT("lockspace", struct lockspace);
+static struct pool stop_request_pool =
+	POOL_INIT("stop_request", struct lockspace_aio_request);
+static struct pool release_request_pool =
+	POOL_INIT("release_request", struct release_request);
+static struct pool tree_round_pool =
+	POOL_INIT("tree_round", struct tree_round);
 
 #define MSG_NAME(x) [MSG_ ## x] = #x
 static const char *msg_names[] = {
@@ -197,6 +680,21 @@ static const char *msg_names[] = {
 	MSG_NAME(LOCKSPACE_STOPPED),
 	MSG_NAME(JOIN_LOCKSPACE),
 	MSG_NAME(LEAVE_LOCKSPACE),
+	MSG_NAME(HEARTBEAT),
+	MSG_NAME(HEARTBEAT_ACK),
+	MSG_NAME(MCAST_SEQ),
+	MSG_NAME(MCAST_NACK),
+	MSG_NAME(MCAST_DATA),
+	MSG_NAME(NODE_FAILED),
+	MSG_NAME(RESTART_LOCKSPACE),
+	MSG_NAME(DEPART),
+	MSG_NAME(DIGEST),
+	MSG_NAME(DIGEST_END),
+	MSG_NAME(MEMBER_STOPPED),
+	MSG_NAME(LOCKSPACE_UNUSED),
+	MSG_NAME(JOIN_REQUEST),
+	MSG_NAME(LEAVE_REQUEST),
+	MSG_NAME(MEMBERSHIP),
 };
 
 static const char *msg_name(enum msg_type type)
@@ -207,15 +705,15 @@ static const char *msg_name(enum msg_type type)
 }
 
 static node_mask_t
-nodeid_mask(int nodeid)
+node_mask(struct node *node)
 {
-	return 1U << (nodeid - 1);
+	return nodeid_mask(node->nodeid);
 }
 
-static node_mask_t
-node_mask(struct node *node)
+static bool
+node_in(node_mask_t mask, struct node *node)
 {
-	return nodeid_mask(node->nodeid);
+	return mask_test(mask, node->nodeid);
 }
 
 /*
@@ -228,18 +726,32 @@ print_nodes(FILE *file, node_mask_t mask)
 	bool first = true;
 
 	fprintf(file, "[");
-	while ((nodeid = ffs(mask))) {
+	for_each_nodeid(nodeid, mask) {
 		if (first) {
 			fprintf(file, "%u", nodeid);
 			first = false;
 		} else {
 			fprintf(file, ", %u", nodeid);
 		}
-		mask &= ~nodeid_mask(nodeid);
 	}
 	fprintf(file, "]");
 }
 
+/*
+ * Set up an epoll instance for dispatching poll callbacks.
+ */
+static void
+init_poll_callbacks(struct poll_callbacks *cbs)
+{
+	cbs->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (cbs->epoll_fd == -1)
+		fail(NULL);
+	cbs->by_fd = NULL;
+	cbs->size = 0;
+	INIT_LIST_HEAD(&cbs->active);
+	INIT_LIST_HEAD(&cbs->removed);
+}
+
 /*
  * Add a file descriptor, poll event mask, and associated callback for polling.
  */
@@ -247,45 +759,69 @@ static void
 add_poll_callback(struct poll_callbacks *cbs, int fd, short events,
 		  void (*callback)(int, short, void *), void *arg)
 {
-	cbs->pollfds = realloc(cbs->pollfds,
-			       (cbs->num + 1) * sizeof(*cbs->pollfds));
-	cbs->callbacks = realloc(cbs->callbacks,
-				 (cbs->num + 1) * sizeof(*cbs->callbacks));
-	if (!cbs->pollfds || !cbs->callbacks)
+	struct epoll_event event;
+	struct poll_callback *pcb;
+
+	if (fd >= cbs->size) {
+		int size = cbs->size ? cbs->size : 64;
+
+		while (size <= fd)
+			size *= 2;
+		cbs->by_fd = realloc(cbs->by_fd, size * sizeof(*cbs->by_fd));
+		if (!cbs->by_fd)
+			fail(NULL);
+		memset(cbs->by_fd + cbs->size, 0,
+		       (size - cbs->size) * sizeof(*cbs->by_fd));
+		cbs->size = size;
+	}
+	pcb = malloc(sizeof(*pcb));
+	if (!pcb)
 		fail(NULL);
-	memset(cbs->pollfds + cbs->num, 0, sizeof(*cbs->pollfds));
-	memset(cbs->callbacks + cbs->num, 0, sizeof(*cbs->callbacks));
-	cbs->pollfds[cbs->num].fd = fd;
-	cbs->pollfds[cbs->num].events = events;
-	cbs->callbacks[cbs->num].callback = callback;
-	cbs->callbacks[cbs->num].arg = arg;
-	cbs->num++;
+	pcb->fd = fd;
+	pcb->events = events;
+	pcb->callback = callback;
+	pcb->arg = arg;
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.ptr = pcb;
+	if (epoll_ctl(cbs->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+		fail(NULL);
+	list_add_tail(&pcb->list, &cbs->active);
+	cbs->by_fd[fd] = pcb;
 }
 
 /*
  * Remove a file descriptor from polling.
+ *
+ * The events returned by the same epoll_wait() call may still refer to the
+ * callback, so it is only freed by free_removed_poll_callbacks() once all
+ * those events have been dispatched.
  */
 static void
 remove_poll_callback(struct poll_callbacks *cbs, int fd)
 {
-	int n;
+	struct poll_callback *pcb;
 
-	for (n = 0; n < cbs->num; n++) {
-		if (cbs->pollfds[n].fd == fd) {
-			memmove(cbs->pollfds + n, cbs->pollfds + n + 1,
-				(cbs->num - n - 1) * sizeof(*cbs->pollfds));
-			memmove(cbs->callbacks + n, cbs->callbacks + n + 1,
-				(cbs->num - n - 1) * sizeof(*cbs->callbacks));
-			cbs->num--;
-			cbs->pollfds =
-				realloc(cbs->pollfds,
-					cbs->num * sizeof(*cbs->pollfds));
-			cbs->callbacks =
-				realloc(cbs->callbacks,
-					cbs->num * sizeof(*cbs->callbacks));
-			break;
-		}
-	}
+	if (fd >= cbs->size || !cbs->by_fd[fd])
+		return;
+	pcb = cbs->by_fd[fd];
+	cbs->by_fd[fd] = NULL;
+	if (epoll_ctl(cbs->epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1 &&
+	    errno != EBADF)
+		fail(NULL);
+	pcb->callback = NULL;
+	list_del(&pcb->list);
+	list_add(&pcb->list, &cbs->removed);
+}
+
+static void
+free_removed_poll_callbacks(struct poll_callbacks *cbs)
+{
+	struct poll_callback *pcb, *tmp;
+
+	list_for_each_entry_safe(pcb, tmp, &cbs->removed, list)
+		free(pcb);
+	INIT_LIST_HEAD(&cbs->removed);
 }
 
 /*
@@ -295,14 +831,200 @@ static void
 update_poll_callback(struct poll_callbacks *cbs, int fd, short events,
 		     void (*callback)(int, short, void *), void *arg)
 {
-	int n;
+	struct poll_callback *pcb;
 
-	for (n = 0; n < cbs->num; n++) {
-		if (cbs->pollfds[n].fd == fd) {
-			cbs->pollfds[n].events = events;
-			cbs->callbacks[n].callback = callback;
-			cbs->callbacks[n].arg = arg;
-			break;
+	if (fd >= cbs->size || !cbs->by_fd[fd])
+		return;
+	pcb = cbs->by_fd[fd];
+	if (pcb->events != events) {
+		struct epoll_event event;
+
+		memset(&event, 0, sizeof(event));
+		event.events = events;
+		event.data.ptr = pcb;
+		if (epoll_ctl(cbs->epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1)
+			fail(NULL);
+		pcb->events = events;
+	}
+	pcb->callback = callback;
+	pcb->arg = arg;
+}
+
+static void proto_event(int fd, short revents, void *arg);
+static void proto_close(struct connection *conn);
+static bool flush_batch(struct connection *conn);
+static void mcast_flush(void);
+static void mcast_barrier(struct connection *conn);
+
+/*
+ * Create the state for an established connection.  The caller takes care of
+ * polling.
+ */
+static struct connection *
+new_connection(int fd, struct node *node)
+{
+	struct connection *conn;
+
+	conn = malloc(sizeof(*conn));
+	if (!conn)
+		fail(NULL);
+	memset(conn, 0, sizeof(*conn));
+	conn->fd = fd;
+	conn->node = node;
+	list_add_tail(&conn->list, &node->connections);
+	INIT_LIST_HEAD(&conn->flush_list);
+	return conn;
+}
+
+/*
+ * Close a connection and discard any queued output.
+ */
+static void
+free_connection(struct connection *conn)
+{
+	struct node *node = conn->node;
+
+	remove_poll_callback(&cbs, conn->fd);
+	close(conn->fd);
+	if (node->outgoing == conn) {
+		struct lockspace *ls;
+
+		/*
+		 * Names queued on this connection may not have made it to
+		 * the peer.
+		 */
+		for (ls = lockspaces; ls; ls = ls->next) {
+			mask_clear(&ls->name_sent, node->nodeid);
+			mask_clear(&ls->digest_seen, node->nodeid);
+		}
+		node->outgoing = NULL;
+	}
+	list_del(&conn->list);
+	list_del(&conn->flush_list);
+	free(conn->out_buf);
+	free(conn->in_buf);
+	free(conn);
+}
+
+static void
+schedule_flush(struct connection *conn)
+{
+	if (list_empty(&conn->flush_list))
+		list_add_tail(&conn->flush_list, &flush_connections);
+}
+
+/*
+ * Append to the output queue of a connection, growing the queue as needed.
+ * Fails when the queue would exceed MAX_SEND_QUEUE.
+ */
+static bool
+queue_output(struct connection *conn, const void *buf, unsigned int len)
+{
+	unsigned int used = conn->out_tail - conn->out_head;
+	unsigned int offset, first;
+
+	if (used + len > conn->out_size) {
+		unsigned int size = conn->out_size ? conn->out_size : MIN_SEND_QUEUE;
+		char *out_buf;
+
+		while (size < used + len)
+			size *= 2;
+		if (size > MAX_SEND_QUEUE)
+			return false;
+		out_buf = malloc(size);
+		if (!out_buf)
+			fail(NULL);
+		offset = conn->out_head & (conn->out_size - 1);
+		first = conn->out_size - offset;
+		if (first > used)
+			first = used;
+		memcpy(out_buf, conn->out_buf + offset, first);
+		memcpy(out_buf + first, conn->out_buf, used - first);
+		free(conn->out_buf);
+		conn->out_buf = out_buf;
+		conn->out_size = size;
+		conn->out_head = 0;
+		conn->out_tail = used;
+	}
+	offset = conn->out_tail & (conn->out_size - 1);
+	first = conn->out_size - offset;
+	if (first > len)
+		first = len;
+	memcpy(conn->out_buf + offset, buf, first);
+	memcpy(conn->out_buf, (const char *)buf + first, len - first);
+	conn->out_tail += len;
+	schedule_flush(conn);
+	return true;
+}
+
+/*
+ * Write out as much of the output queue of a connection as the socket will
+ * take.  Poll for POLLOUT while output remains queued.
+ */
+static int
+flush_connection(struct connection *conn)
+{
+	short events = POLLIN;
+
+	while (conn->out_head != conn->out_tail) {
+		unsigned int used = conn->out_tail - conn->out_head;
+		unsigned int offset = conn->out_head & (conn->out_size - 1);
+		unsigned int first = conn->out_size - offset;
+		struct iovec iov[2];
+		struct msghdr msghdr = {
+			.msg_iov = iov,
+			.msg_iovlen = 1,
+		};
+		ssize_t ret;
+
+		iov[0].iov_base = conn->out_buf + offset;
+		iov[0].iov_len = first < used ? first : used;
+		if (first < used) {
+			iov[1].iov_base = conn->out_buf;
+			iov[1].iov_len = used - first;
+			msghdr.msg_iovlen = 2;
+		}
+		/* Like writev(), but without raising SIGPIPE. */
+		ret = sendmsg(conn->fd, &msghdr, MSG_NOSIGNAL);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				events |= POLLOUT;
+				break;
+			}
+			return -1;
+		}
+		conn->out_head += ret;
+	}
+	update_poll_callback(&cbs, conn->fd, events, proto_event, conn);
+	return 0;
+}
+
+/*
+ * Flush the output queues of all connections with queued output.  Called once
+ * per event loop iteration, so messages queued in the meantime are sent with
+ * a single system call per connection.
+ */
+static void
+flush_all_connections(void)
+{
+	mcast_flush();
+	while (!list_empty(&flush_connections)) {
+		struct connection *conn =
+			list_first_entry(&flush_connections,
+					 struct connection, flush_list);
+
+		if (!flush_batch(conn)) {
+			fprintf(stderr, "%u: Send queue overflow\n",
+				conn->node->nodeid);
+			proto_close(conn);
+			continue;
+		}
+		list_del_init(&conn->flush_list);
+		if (flush_connection(conn) == -1) {
+			fprintf(stderr, "%u: %m\n", conn->node->nodeid);
+			proto_close(conn);
 		}
 	}
 }
@@ -313,834 +1035,3213 @@ update_poll_callback(struct poll_callbacks *cbs, int fd, short events,
 static void
 close_connections(struct node *node)
 {
-	if (node->outgoing_fd != -1) {
-		close(node->outgoing_fd);
-		remove_poll_callback(&cbs, node->outgoing_fd);
-		node->outgoing_fd = -1;
+	while (!list_empty(&node->connections)) {
+		struct connection *conn =
+			list_first_entry(&node->connections,
+					 struct connection, list);
+
+		free_connection(conn);
 	}
 	if (node->connecting_fd != -1) {
-		close(node->connecting_fd);
 		remove_poll_callback(&cbs, node->connecting_fd);
+		close(node->connecting_fd);
 		node->connecting_fd = -1;
 	}
-	connected_nodes &= ~node_mask(node);
+	mask_clear(&connected_nodes, node->nodeid);
 }
 
 /*
- * Close the connections to all peer nodes.
+ * Close the connections to all peer nodes.  Hand whatever output is still
+ * queued to the kernel first; there is no point in waiting for the peers to
+ * accept more, and errors no longer matter at this point.
  */
 static void
 close_all_connections(void)
 {
+	struct poll_callback *pcb, *tmp;
 	struct node *node;
-	int n = 0;
 
-	while (n < cbs.num) {
-		if (cbs.callbacks[n].arg == LISTENING_SOCKET_MARKER) {
-			remove_poll_callback(&cbs, cbs.pollfds[n].fd);
-			continue;
-		}
-		n++;
+	list_for_each_entry_safe(pcb, tmp, &cbs.active, list) {
+		if (pcb->arg == LISTENING_SOCKET_MARKER)
+			remove_poll_callback(&cbs, pcb->fd);
 	}
 
-	for (node = nodes; node; node = node->next)
+	mcast_flush();
+	for (node = nodes; node; node = node->next) {
+		struct connection *conn;
+
+		list_for_each_entry(conn, &node->connections, list) {
+			if (flush_batch(conn))
+				flush_connection(conn);
+		}
+		del_timer(&node->reconnect_timer);
+		del_timer(&node->heartbeat_timer);
 		close_connections(node);
+	}
+}
+
+/*
+ * Schedule the next attempt to connect to a peer node after losing or failing
+ * to establish a connection.
+ */
+static void
+schedule_reconnect(struct node *node)
+{
+	unsigned int delay = RECONNECT_MAX_MS;
+
+	if (shut_down || node->outgoing || node->connecting_fd != -1)
+		return;
+	if (node->connect_attempts < 16)
+		delay = RECONNECT_MIN_MS << node->connect_attempts;
+	if (delay > RECONNECT_MAX_MS)
+		delay = RECONNECT_MAX_MS;
+	delay = delay / 2 + random() % (delay / 2 + 1);
+	node->connect_attempts++;
+	if (verbose) {
+		printf("Reconnecting to node %u in %u ms\n", node->nodeid, delay);
+		fflush(stdout);
+	}
+	add_timer(&node->reconnect_timer, delay);
 }
 
 /*
- * Send a FakeDLM message to a peer node.
+ * Encode a message in the original format.
  */
 static bool
-send_msg(struct node *node, enum msg_type type, const char *lockspace_name)
+queue_legacy_msg(struct connection *conn, enum msg_type type,
+		 struct lockspace *ls)
 {
 	struct proto_msg msg = {
 		.msg = htons(type),
 	};
-	int ret;
 
-	if (node->outgoing_fd == -1)
+	if (ls)
+		strncpy(msg.lockspace_name, ls->name, DLM_LOCKSPACE_LEN);
+	return queue_output(conn, &msg, sizeof(msg));
+}
+
+/*
+ * Queue the batched global_ids of a connection as a single message.
+ */
+static bool
+flush_batch(struct connection *conn)
+{
+	struct proto_hdr hdr = {
+		.msg = conn->batch_type,
+	};
+	unsigned int len;
+
+	if (!conn->batch_len)
+		return true;
+	len = sizeof(hdr) + (conn->batch_len - 1) * sizeof(uint32_t);
+	hdr.len = htons(len);
+	hdr.global_id = conn->batch[0];
+	if (conn->batch_len > 1)
+		hdr.flags = MSG_F_BATCH;
+	conn->batch_len = 0;
+	return queue_output(conn, &hdr, sizeof(hdr)) &&
+	       queue_output(conn, conn->batch + 1, len - sizeof(hdr));
+}
+
+/*
+ * Encode a version 2 message.  The lockspace name is only included if the
+ * peer doesn't know the lockspace's global_id, yet.  Messages that only need
+ * the global_id are batched when the peer supports it.
+ */
+static bool
+queue_v2_msg(struct connection *conn, enum msg_type type,
+	     struct lockspace *ls)
+{
+	struct {
+		struct proto_hdr hdr;
+		char name[DLM_LOCKSPACE_LEN];
+	} __attribute__((packed)) msg = {
+		.hdr = {
+			.msg = type,
+		},
+	};
+	struct node *node = conn->node;
+	unsigned int len = sizeof(msg.hdr);
+
+	mcast_barrier(conn);
+	if (ls && node_in(ls->name_sent, node) && (conn->caps & CAP_BATCH) &&
+	    type != MSG_CLOSE) {
+		if (conn->batch_len &&
+		    (conn->batch_type != type || conn->batch_len == MAX_BATCH) &&
+		    !flush_batch(conn))
+			return false;
+		conn->batch_type = type;
+		conn->batch[conn->batch_len++] = htonl(ls->global_id);
+		schedule_flush(conn);
+		return true;
+	}
+	if (!flush_batch(conn))
+		return false;
+	if (ls) {
+		msg.hdr.global_id = htonl(ls->global_id);
+		if (!node_in(ls->name_sent, node)) {
+			unsigned int name_len = strlen(ls->name);
+
+			memcpy(msg.name, ls->name, name_len);
+			len += name_len;
+			msg.hdr.flags |= MSG_F_NAME;
+			mask_set(&ls->name_sent, node->nodeid);
+		}
+	}
+	msg.hdr.len = htons(len);
+	return queue_output(conn, &msg, len);
+}
+
+/*
+ * Queue a FakeDLM message for sending to a peer node.  When the peer has
+ * stopped reading, the connection is shut down; the resulting end-of-file
+ * condition is then handled like any other lost connection.
+ */
+static bool
+send_msg(struct node *node, enum msg_type type, struct lockspace *ls)
+{
+	struct connection *conn = node->outgoing;
+	bool queued;
+
+	if (!conn)
 		return false;
 
 	if (verbose) {
 		printf("> %u %s", node->nodeid,
 		       msg_name(type));
-		if (lockspace_name)
-			printf(" %s", lockspace_name);
+		if (ls)
+			printf(" %s", ls->name);
 		printf("\n");
 		fflush(stdout);
 	}
-	if (lockspace_name)
-		strncpy(msg.lockspace_name, lockspace_name,
-			DLM_LOCKSPACE_LEN);
-	ret = write(node->outgoing_fd, &msg, sizeof(msg));
-	if (ret != sizeof(msg)) {
-		if (ret > 0)
-			errno = EIO;
-		fprintf(stderr, "%u: %m\n", node->nodeid);
-		close_connections(node);
+	if (conn->send_v2)
+		queued = queue_v2_msg(conn, type, ls);
+	else
+		queued = queue_legacy_msg(conn, type, ls);
+	if (!queued) {
+		fprintf(stderr, "%u: Send queue overflow\n", node->nodeid);
+		shutdown(conn->fd, SHUT_RDWR);
 		return false;
 	}
 	return true;
 }
 
+static uint32_t
+local_caps(void)
+{
+	uint32_t caps = PROTO_CAPS;
+
+	if (mcast_fd != -1)
+		caps |= CAP_MULTICAST;
+	if (evict_failed)
+		caps |= CAP_EVICT;
+	if (!tree_fanout && mcast_fd == -1)
+		caps |= CAP_SCOPED;
+	if (coordinated)
+		caps |= CAP_COORD;
+	return caps;
+}
+
 /*
- * Create a new node in-memory object and look up the node's addresses.
+ * Send a version 2 message consisting of only a header on a connection.
  */
-static struct node *
-new_node(const char *name)
+static void
+send_hdr_msg(struct connection *conn, enum msg_type type, uint32_t id)
 {
-	struct node *node;
+	struct proto_hdr hdr = {
+		.len = htons(sizeof(hdr)),
+		.msg = type,
+		.global_id = htonl(id),
+	};
 
-	node = malloc(sizeof(*node));
+	if (debug) {
+		printf("> %u %s %u\n", conn->node->nodeid, msg_name(type), id);
+		fflush(stdout);
+	}
+	if (type < MSG_HEARTBEAT || type > MSG_MCAST_DATA)
+		mcast_barrier(conn);
+	if (!flush_batch(conn) || !queue_output(conn, &hdr, sizeof(hdr)))
+		shutdown(conn->fd, SHUT_RDWR);
+}
+
+/*
+ * Send a HELLO or HELLO_ACK on a connection.  These are always sent in the
+ * original format.
+ */
+static void
+send_hello(struct connection *conn, enum hello_type type)
+{
+	struct proto_msg msg = {
+		.msg = htons(MSG_LOCKSPACE_STOPPED),
+	};
+	struct proto_hello hello = {
+		.magic = HELLO_MAGIC,
+		.type = type,
+		.version = PROTO_VERSION,
+		.caps = htonl(local_caps()),
+	};
+
+	memcpy(msg.lockspace_name, &hello, sizeof(hello));
+	if (!queue_output(conn, &msg, sizeof(msg)))
+		shutdown(conn->fd, SHUT_RDWR);
+}
+
+static struct mcast_packet *
+mcast_packet(uint32_t seq)
+{
+	return &mcast_history[seq % MCAST_HISTORY];
+}
+
+/*
+ * Send the multicast packet being assembled, if any, and start the next one.
+ * Packets that cannot be sent are recovered from like lost packets.
+ */
+static void
+mcast_flush(void)
+{
+	struct mcast_packet *packet;
+	struct mcast_hdr hdr;
+	struct iovec iov[2];
+	struct msghdr msghdr = {
+		.msg_name = &mcast_addr,
+		.msg_namelen = mcast_addr_len,
+		.msg_iov = iov,
+		.msg_iovlen = 2,
+	};
+
+	if (mcast_fd == -1)
+		return;
+	packet = mcast_packet(mcast_seq);
+	if (!packet->len)
+		return;
+	hdr.nodeid = htons(local_node->nodeid);
+	hdr.reserved = 0;
+	hdr.seq = htonl(mcast_seq);
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = packet->data;
+	iov[1].iov_len = packet->len;
+	if (sendmsg(mcast_fd, &msghdr, 0) == -1 && errno != EAGAIN)
+		warn("multicast: %m");
+	mcast_seq++;
+	packet = mcast_packet(mcast_seq);
+	packet->seq = mcast_seq;
+	packet->len = 0;
+	del_timer(&mcast_announce_timer);
+	add_timer(&mcast_announce_timer, MCAST_ANNOUNCE_MS);
+}
+
+/*
+ * Announce the sequence number of our next multicast packet to a peer.
+ */
+static void
+mcast_announce(struct connection *conn)
+{
+	conn->mcast_announced = mcast_seq;
+	send_hdr_msg(conn, MSG_MCAST_SEQ, mcast_seq);
+}
+
+/*
+ * Nothing has been multicast for MCAST_ANNOUNCE_MS: announce our next
+ * sequence number to the peers that don't know it yet, so that they will
+ * notice if the last packets were lost.
+ */
+static void
+mcast_announce_timeout(struct timer *timer)
+{
+	struct node *node;
+
+	for (node = nodes; node; node = node->next) {
+		struct connection *conn = node->outgoing;
+
+		if (conn && conn->send_v2 && (conn->caps & CAP_MULTICAST) &&
+		    conn->mcast_announced != mcast_seq)
+			mcast_announce(conn);
+	}
+}
+
+/*
+ * Make sure that a peer will process what we queue on a connection next only
+ * after the multicast packets we have sent or assembled so far: send the
+ * packet being assembled, and announce the sequence number that follows.
+ */
+static void
+mcast_barrier(struct connection *conn)
+{
+	if (!conn->send_v2 || !(conn->caps & CAP_MULTICAST))
+		return;
+	mcast_flush();
+	if (conn->mcast_announced != mcast_seq)
+		mcast_announce(conn);
+}
+
+/*
+ * Have all of the given peer nodes agreed to a capability?
+ */
+static bool
+peers_capable(node_mask_t peers, uint32_t cap)
+{
+	int nodeid;
+
+	if (mask_empty(peers))
+		return false;
+	for_each_nodeid(nodeid, peers) {
+		struct connection *conn = nodes_by_id[nodeid]->outgoing;
+
+		if (!conn || !conn->send_v2 || !(conn->caps & cap))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Add a message to the multicast packet being assembled.  Consecutive
+ * messages of the same type are batched like on TCP connections.
+ */
+static void
+mcast_queue_msg(node_mask_t peers, enum msg_type type, struct lockspace *ls)
+{
+	struct mcast_packet *packet = mcast_packet(mcast_seq);
+	struct proto_hdr hdr = {
+		.msg = type,
+		.global_id = htonl(ls->global_id),
+	};
+	unsigned int name_len = 0;
+
+	if (!mask_subset(peers, ls->name_sent)) {
+		name_len = strlen(ls->name);
+		hdr.flags = MSG_F_NAME;
+		ls->name_sent = mask_or(ls->name_sent, peers);
+	}
+	if (packet->len && !name_len) {
+		struct proto_hdr last;
+
+		memcpy(&last, packet->data + packet->last, sizeof(last));
+		if (last.msg == type && !(last.flags & MSG_F_NAME) &&
+		    ntohs(last.len) < sizeof(last) +
+				      (MAX_BATCH - 1) * sizeof(uint32_t) &&
+		    packet->len + sizeof(uint32_t) <= sizeof(packet->data)) {
+			last.flags |= MSG_F_BATCH;
+			last.len = htons(ntohs(last.len) + sizeof(uint32_t));
+			memcpy(packet->data + packet->last, &last, sizeof(last));
+			memcpy(packet->data + packet->len, &hdr.global_id,
+			       sizeof(uint32_t));
+			packet->len += sizeof(uint32_t);
+			return;
+		}
+	}
+	if (packet->len + sizeof(hdr) + name_len > sizeof(packet->data)) {
+		mcast_flush();
+		packet = mcast_packet(mcast_seq);
+	}
+	hdr.len = htons(sizeof(hdr) + name_len);
+	packet->last = packet->len;
+	memcpy(packet->data + packet->len, &hdr, sizeof(hdr));
+	memcpy(packet->data + packet->len + sizeof(hdr), ls->name, name_len);
+	packet->len += sizeof(hdr) + name_len;
+}
+
+/*
+ * Spanning trees for relaying messages (--tree).  The tree of a round is
+ * rooted at the node that started the round, and consists of the nodes the
+ * root knew about at that time (relay->nodes): they are numbered in node ID
+ * order starting from the root, and the children of node n are nodes
+ * n * fanout + 1 to n * fanout + fanout.  Nodes we are not connected to are
+ * skipped over, and their children are adopted by their parents.
+ */
+static int
+tree_pos(const struct relay *relay, int nodeid)
+{
+	int size = mask_weight(relay->nodes);
+
+	return (mask_rank(relay->nodes, nodeid) -
+		mask_rank(relay->nodes, relay->origin->nodeid) + size) % size;
+}
+
+static int
+tree_nodeid(const struct relay *relay, int pos)
+{
+	int size = mask_weight(relay->nodes);
+
+	return mask_nth(relay->nodes,
+			(mask_rank(relay->nodes, relay->origin->nodeid) + pos) %
+			size);
+}
+
+/*
+ * The nodes in the subtree at position pos, including pos itself.  The
+ * subtree consists of consecutive ranges of positions, one per level.
+ */
+static node_mask_t
+tree_subtree(const struct relay *relay, int pos)
+{
+	node_mask_t subtree = NO_NODES;
+	int size = mask_weight(relay->nodes), first = pos, last = pos;
+
+	while (first < size) {
+		int n;
+
+		for (n = first; n <= last && n < size; n++)
+			mask_set(&subtree, tree_nodeid(relay, n));
+		first = first * relay->fanout + 1;
+		last = last * relay->fanout + relay->fanout;
+	}
+	return subtree;
+}
+
+/* The connected nodes directly below position pos. */
+static node_mask_t
+tree_children(const struct relay *relay, int pos)
+{
+	node_mask_t children = NO_NODES;
+	int size = mask_weight(relay->nodes), fanout = relay->fanout, n;
+
+	for (n = pos * fanout + 1; n <= pos * fanout + fanout && n < size; n++) {
+		int nodeid = tree_nodeid(relay, n);
+
+		if (mask_test(connected_nodes, nodeid))
+			mask_set(&children, nodeid);
+		else
+			children = mask_or(children, tree_children(relay, n));
+	}
+	return children;
+}
+
+/* Our closest connected ancestor, or NULL. */
+static struct node *
+tree_parent(const struct relay *relay)
+{
+	int pos = tree_pos(relay, local_node->nodeid);
+
+	while (pos) {
+		int nodeid;
+
+		pos = (pos - 1) / relay->fanout;
+		nodeid = tree_nodeid(relay, pos);
+		if (mask_test(connected_nodes, nodeid))
+			return nodes_by_id[nodeid];
+	}
+	return NULL;
+}
+
+/*
+ * Send a message relayed along a spanning tree.  Relayed messages are not
+ * batched.
+ */
+static bool
+send_relay_msg(struct node *node, enum msg_type type, struct lockspace *ls,
+	       const struct relay *relay)
+{
+	struct connection *conn = node->outgoing;
+	char buf[sizeof(struct proto_hdr) + sizeof(struct proto_relay) +
+		 2 * sizeof(node_mask_t) + DLM_LOCKSPACE_LEN];
+	struct proto_hdr hdr = {
+		.msg = type,
+		.flags = MSG_F_RELAY,
+		.global_id = htonl(ls->global_id),
+	};
+	struct proto_relay rel = {
+		.origin = htons(relay->origin->nodeid),
+		.fanout = relay->fanout,
+		.mask_words = NODE_MASK_WORDS,
+	};
+	unsigned int len = sizeof(hdr) + sizeof(rel);
+	int n;
+
+	if (!conn)
+		return false;
+	if (verbose) {
+		printf("> %u %s %s (%u)\n", node->nodeid, msg_name(type),
+		       ls->name, relay->origin->nodeid);
+		fflush(stdout);
+	}
+	for (n = 0; n < NODE_MASK_WORDS; n++) {
+		uint64_t word = htobe64(relay->nodes.w[n]);
+
+		memcpy(buf + len, &word, sizeof(word));
+		len += sizeof(word);
+	}
+	if (type == MSG_LOCKSPACE_STOPPED) {
+		for (n = 0; n < NODE_MASK_WORDS; n++) {
+			uint64_t word = htobe64(relay->stopped.w[n]);
+
+			memcpy(buf + len, &word, sizeof(word));
+			len += sizeof(word);
+		}
+	}
+	if (!node_in(ls->name_sent, node)) {
+		unsigned int name_len = strlen(ls->name);
+
+		memcpy(buf + len, ls->name, name_len);
+		len += name_len;
+		hdr.flags |= MSG_F_NAME;
+		mask_set(&ls->name_sent, node->nodeid);
+	}
+	hdr.len = htons(len);
+	memcpy(buf, &hdr, sizeof(hdr));
+	memcpy(buf + sizeof(hdr), &rel, sizeof(rel));
+	if (!flush_batch(conn) || !queue_output(conn, buf, len)) {
+		fprintf(stderr, "%u: Send queue overflow\n", node->nodeid);
+		shutdown(conn->fd, SHUT_RDWR);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Queue a MSG_DIGEST message of len bytes including the header.
+ */
+static bool
+queue_digest(struct connection *conn, char *buf, unsigned int len,
+	     unsigned int count)
+{
+	struct proto_hdr hdr = {
+		.len = htons(len),
+		.msg = MSG_DIGEST,
+	};
+
+	if (verbose) {
+		printf("> %u %s (%u lockspaces)\n", conn->node->nodeid,
+		       msg_name(MSG_DIGEST), count);
+		fflush(stdout);
+	}
+	memcpy(buf, &hdr, sizeof(hdr));
+	mcast_barrier(conn);
+	return flush_batch(conn) && queue_output(conn, buf, len);
+}
+
+/*
+ * Send the digest of the lockspaces we are a member of to a newly connected
+ * peer, followed by MSG_DIGEST_END.
+ */
+static void
+send_digest(struct connection *conn)
+{
+	struct node *node = conn->node;
+	char buf[MAX_DIGEST_LEN];
+	unsigned int len = sizeof(struct proto_hdr), count = 0;
+	struct lockspace *ls;
+
+	for (ls = lockspaces; ls; ls = ls->next) {
+		struct proto_digest entry = {
+			.global_id = htonl(ls->global_id),
+			.mask_words = NODE_MASK_WORDS,
+		};
+		unsigned int n;
+
+		if (!node_in(ls->members, local_node))
+			continue;
+		if (!node_in(ls->name_sent, node))
+			entry.name_len = strlen(ls->name);
+		if (len + sizeof(entry) + sizeof(node_mask_t) +
+		    entry.name_len > sizeof(buf)) {
+			if (!queue_digest(conn, buf, len, count))
+				goto overflow;
+			len = sizeof(struct proto_hdr);
+			count = 0;
+		}
+		memcpy(buf + len, &entry, sizeof(entry));
+		len += sizeof(entry);
+		for (n = 0; n < NODE_MASK_WORDS; n++) {
+			uint64_t word = htobe64(ls->members.w[n]);
+
+			memcpy(buf + len, &word, sizeof(word));
+			len += sizeof(word);
+		}
+		memcpy(buf + len, ls->name, entry.name_len);
+		len += entry.name_len;
+		mask_set(&ls->name_sent, node->nodeid);
+		count++;
+	}
+	if (count && !queue_digest(conn, buf, len, count))
+		goto overflow;
+	send_hdr_msg(conn, MSG_DIGEST_END, 0);
+	return;
+
+overflow:
+	fprintf(stderr, "%u: Send queue overflow\n", node->nodeid);
+	shutdown(conn->fd, SHUT_RDWR);
+}
+
+/*
+ * Forward a relayed message to our children in the spanning tree.  Returns
+ * whether there were any.
+ */
+static bool
+tree_forward(enum msg_type type, struct lockspace *ls,
+	     const struct relay *relay)
+{
+	node_mask_t children;
+	bool sent = false;
+	int nodeid;
+
+	children = tree_children(relay, tree_pos(relay, local_node->nodeid));
+	for_each_nodeid(nodeid, children)
+		sent |= send_relay_msg(nodes_by_id[nodeid], type, ls, relay);
+	return sent;
+}
+
+/*
+ * Send a message to all peer nodes, along a spanning tree or by multicast if
+ * possible.  Returns whether any peers were connected.
+ */
+static bool
+broadcast_msg(enum msg_type type, struct lockspace *ls)
+{
+	node_mask_t peers = mask_andnot(connected_nodes, node_mask(local_node));
+	bool sent = false;
+	int nodeid;
+
+	if (tree_fanout && peers_capable(peers, CAP_RELAY)) {
+		struct relay relay = {
+			.origin = local_node,
+			.fanout = tree_fanout,
+			.nodes = all_nodes,
+		};
+
+		return tree_forward(type, ls, &relay);
+	}
+	if (mcast_fd != -1 && peers_capable(peers, CAP_MULTICAST)) {
+		if (verbose) {
+			printf("> * %s %s\n", msg_name(type), ls->name);
+			fflush(stdout);
+		}
+		mcast_queue_msg(peers, type, ls);
+		return true;
+	}
+	for_each_nodeid(nodeid, peers)
+		sent |= send_msg(nodes_by_id[nodeid], type, ls);
+	return sent;
+}
+
+/*
+ * Does a peer take part in scoped rounds (CAP_SCOPED)?
+ */
+static bool
+scoped_peer(struct node *node)
+{
+	struct connection *conn = node->outgoing;
+
+	return conn && conn->send_v2 && (conn->caps & CAP_SCOPED);
+}
+
+/*
+ * The peers a round for a lockspace needs to reach: the members, the nodes
+ * with rounds of their own in progress or pending changes, and the peers that
+ * don't take part in scoped rounds and keep track of all lockspaces.
+ */
+static node_mask_t
+round_peers(struct lockspace *ls)
+{
+	node_mask_t peers = mask_andnot(connected_nodes, node_mask(local_node));
+	node_mask_t users = mask_or(mask_or(ls->members, ls->stopping),
+				    mask_or(ls->joining, ls->leaving));
+	int nodeid;
+
+	for_each_nodeid(nodeid, peers) {
+		struct node *node = nodes_by_id[nodeid];
+
+		if (!node_in(users, node) && scoped_peer(node))
+			mask_clear(&peers, nodeid);
+	}
+	return peers;
+}
+
+/*
+ * Send a message of a round to the given peers; rounds that involve all peers
+ * are broadcast.  Returns whether any of the peers were connected.
+ */
+static bool
+round_msg(enum msg_type type, struct lockspace *ls, node_mask_t peers)
+{
+	bool sent = false;
+	int nodeid;
+
+	if (mask_equal(peers, mask_andnot(connected_nodes,
+					  node_mask(local_node))))
+		return broadcast_msg(type, ls);
+	for_each_nodeid(nodeid, peers)
+		sent |= send_msg(nodes_by_id[nodeid], type, ls);
+	return sent;
+}
+
+/*
+ * Have all connected nodes our own round has been sent to stopped the
+ * lockspace?
+ */
+static bool
+round_stopped(struct lockspace *ls)
+{
+	node_mask_t round = mask_or(ls->round, node_mask(local_node));
+
+	return mask_subset(mask_and(round, connected_nodes), ls->stopped);
+}
+
+/*
+ * Tell a peer in a scoped round that we are not using a lockspace.  We may
+ * not even know the lockspace, so it is only referred to by global_id.
+ */
+static void
+send_unused(struct node *node, uint32_t id)
+{
+	struct connection *conn = node->outgoing;
+	struct proto_hdr hdr = {
+		.len = htons(sizeof(hdr)),
+		.msg = MSG_LOCKSPACE_UNUSED,
+		.global_id = htonl(id),
+	};
+
+	if (!conn)
+		return;
+	if (verbose) {
+		printf("> %u %s %08x\n", node->nodeid,
+		       msg_name(MSG_LOCKSPACE_UNUSED), id);
+		fflush(stdout);
+	}
+	mcast_barrier(conn);
+	if (!flush_batch(conn) || !queue_output(conn, &hdr, sizeof(hdr)))
+		shutdown(conn->fd, SHUT_RDWR);
+}
+
+/*
+ * The coordinator of a lockspace (--coordinated): the connected node for
+ * which a hash of the lockspace's global_id and the node ID is highest.  The
+ * nodes agree on the coordinator as long as they agree on who is connected,
+ * and the lockspaces are spread evenly over the nodes.
+ */
+static struct node *
+lockspace_coordinator(struct lockspace *ls)
+{
+	struct node *coordinator = NULL;
+	uint32_t best = 0;
+	int nodeid;
+
+	for_each_nodeid(nodeid, connected_nodes) {
+		uint32_t hash = ls->global_id ^ (nodeid * 0x9e3779b9);
+
+		hash = (hash ^ (hash >> 16)) * 0x85ebca6b;
+		hash = (hash ^ (hash >> 13)) * 0xc2b2ae35;
+		hash ^= hash >> 16;
+		if (!coordinator || hash > best) {
+			coordinator = nodes_by_id[nodeid];
+			best = hash;
+		}
+	}
+	return coordinator;
+}
+
+/*
+ * Send the result of a coordinated round to a peer.  Not batched.
+ */
+static bool
+send_membership(struct node *node, struct lockspace *ls)
+{
+	struct connection *conn = node->outgoing;
+	char buf[sizeof(struct proto_hdr) + sizeof(struct proto_membership) +
+		 3 * sizeof(node_mask_t) + DLM_LOCKSPACE_LEN];
+	const node_mask_t *masks[] = { &ls->members, &ls->joining,
+				       &ls->leaving };
+	struct proto_hdr hdr = {
+		.msg = MSG_MEMBERSHIP,
+		.global_id = htonl(ls->global_id),
+	};
+	struct proto_membership pm = {
+		.mask_words = NODE_MASK_WORDS,
+	};
+	unsigned int len = sizeof(hdr) + sizeof(pm);
+	int m, n;
+
+	if (!conn || !conn->send_v2)
+		return false;
+	if (verbose) {
+		printf("> %u %s %s\n", node->nodeid, msg_name(MSG_MEMBERSHIP),
+		       ls->name);
+		fflush(stdout);
+	}
+	for (m = 0; m < ARRAY_SIZE(masks); m++) {
+		for (n = 0; n < NODE_MASK_WORDS; n++) {
+			uint64_t word = htobe64(masks[m]->w[n]);
+
+			memcpy(buf + len, &word, sizeof(word));
+			len += sizeof(word);
+		}
+	}
+	if (!node_in(ls->name_sent, node)) {
+		unsigned int name_len = strlen(ls->name);
+
+		memcpy(buf + len, ls->name, name_len);
+		len += name_len;
+		hdr.flags |= MSG_F_NAME;
+		mask_set(&ls->name_sent, node->nodeid);
+	}
+	hdr.len = htons(len);
+	memcpy(buf, &hdr, sizeof(hdr));
+	memcpy(buf + sizeof(hdr), &pm, sizeof(pm));
+	mcast_barrier(conn);
+	if (!flush_batch(conn) || !queue_output(conn, buf, len)) {
+		fprintf(stderr, "%u: Send queue overflow\n", node->nodeid);
+		shutdown(conn->fd, SHUT_RDWR);
+		return false;
+	}
+	return true;
+}
+
+static void connect_to_peer(struct node *node);
+static void heartbeat_timeout(struct timer *timer);
+
+/*
+ * Either the time to reconnect to a peer node has come, or a connection
+ * attempt has timed out.
+ */
+static void
+reconnect_timeout(struct timer *timer)
+{
+	struct node *node = container_of(timer, struct node, reconnect_timer);
+
+	if (node->connecting_fd != -1) {
+		remove_poll_callback(&cbs, node->connecting_fd);
+		close(node->connecting_fd);
+		node->connecting_fd = -1;
+		schedule_reconnect(node);
+	} else if (!node->outgoing) {
+		connect_to_peer(node);
+	}
+}
+
+/*
+ * Create a new node in-memory object and look up the node's addresses.
+ */
+static struct node *
+new_node(const char *name)
+{
+	struct node *node;
+
+	node = malloc(sizeof(*node));
 	if (!node)
 		fail(NULL);
 	memset(node, 0, sizeof(*node));
 	node->name = strdup(name);
 	if (!node->name)
 		fail(NULL);
-	node->weight = 1;
-	node->addr = find_addr(name);
-	node->nodeid = -1;
-	node->outgoing_fd = -1;
-	node->connecting_fd = -1;
-	return node;
+	node->weight = 1;
+	if (!unix_dir)
+		node->addr = find_addr(name);
+	node->nodeid = -1;
+	INIT_LIST_HEAD(&node->connections);
+	node->connecting_fd = -1;
+	init_timer(&node->reconnect_timer, reconnect_timeout);
+	init_timer(&node->heartbeat_timer, heartbeat_timeout);
+	return node;
+}
+
+static uint32_t
+global_id(const char *name)
+{
+	char full_name[strlen(name) + 8];
+
+	snprintf(full_name, sizeof(full_name), "dlm:ls:%s", name);
+	return cpgname_to_crc(full_name, strlen(full_name) + 1);
+}
+
+static unsigned int
+lockspace_slot(struct lockspace_table *table, uint32_t global_id)
+{
+	return (global_id * 0x9e3779b1U) >> (32 - table->bits);
+}
+
+static void
+insert_lockspace_slot(struct lockspace_table *table, struct lockspace *ls)
+{
+	unsigned int mask = (1U << table->bits) - 1;
+	unsigned int n;
+
+	for (n = lockspace_slot(table, ls->global_id);
+	     table->slots[n];
+	     n = (n + 1) & mask)
+		/* nothing */ ;
+	table->slots[n] = ls;
+}
+
+/*
+ * Add a lockspace to the lockspace table, growing the table when it gets more
+ * than three quarters full.
+ */
+static void
+insert_lockspace(struct lockspace_table *table, struct lockspace *ls)
+{
+	if (!table->bits || (table->num + 1) * 4 > (3U << table->bits)) {
+		struct lockspace **old_slots = table->slots;
+		unsigned int old_size = table->bits ? 1U << table->bits : 0;
+		unsigned int n;
+
+		table->bits = table->bits ? table->bits + 1 : 6;
+		table->slots = calloc(1U << table->bits, sizeof(*table->slots));
+		if (!table->slots)
+			fail(NULL);
+		for (n = 0; n < old_size; n++) {
+			if (old_slots[n])
+				insert_lockspace_slot(table, old_slots[n]);
+		}
+		free(old_slots);
+	}
+	insert_lockspace_slot(table, ls);
+	table->num++;
+}
+
+static struct lockspace *
+find_lockspace(const char *name)
+{
+	struct lockspace_table *table = &lockspace_table;
+	uint32_t id = global_id(name);
+	unsigned int mask, n;
+
+	if (!table->bits)
+		return NULL;
+	mask = (1U << table->bits) - 1;
+	for (n = lockspace_slot(table, id);
+	     table->slots[n];
+	     n = (n + 1) & mask) {
+		struct lockspace *ls = table->slots[n];
+
+		if (ls->global_id == id && strcmp(name, ls->name) == 0)
+			return ls;
+	}
+	return NULL;
+}
+
+/*
+ * Look up a lockspace by global_id only.  Like DLM itself, this assumes that
+ * lockspace names don't collide.
+ */
+static struct lockspace *
+find_lockspace_by_id(uint32_t id)
+{
+	struct lockspace_table *table = &lockspace_table;
+	unsigned int mask, n;
+
+	if (!table->bits)
+		return NULL;
+	mask = (1U << table->bits) - 1;
+	for (n = lockspace_slot(table, id);
+	     table->slots[n];
+	     n = (n + 1) & mask) {
+		struct lockspace *ls = table->slots[n];
+
+		if (ls->global_id == id)
+			return ls;
+	}
+	return NULL;
+}
+
+/*
+ * Set the minor device number of a lockspace, and update the index from minor
+ * device numbers to lockspaces.
+ */
+static void
+set_lockspace_minor(struct lockspace *ls, int minor)
+{
+	if (ls->minor >= 0 && minor_lockspaces[ls->minor] == ls)
+		minor_lockspaces[ls->minor] = NULL;
+	ls->minor = minor;
+	if (minor < 0)
+		return;
+	if (minor >= minor_lockspaces_size) {
+		int size = minor_lockspaces_size ? minor_lockspaces_size : 256;
+
+		while (size <= minor)
+			size *= 2;
+		minor_lockspaces = realloc(minor_lockspaces,
+					   size * sizeof(*minor_lockspaces));
+		if (!minor_lockspaces)
+			fail(NULL);
+		memset(minor_lockspaces + minor_lockspaces_size, 0,
+		       (size - minor_lockspaces_size) * sizeof(*minor_lockspaces));
+		minor_lockspaces_size = size;
+	}
+	minor_lockspaces[minor] = ls;
+}
+
+static struct lockspace *
+find_lockspace_by_minor(int minor)
+{
+	if (minor < 0 || minor >= minor_lockspaces_size)
+		return NULL;
+	return minor_lockspaces[minor];
+}
+
+/*
+ * Create a new lockspace in-memory object.
+ */
+static struct lockspace *
+new_lockspace(const char *name)
+{
+	struct lockspace *ls;
+
+	ls = pool_alloc(&lockspace_pool);
+	strncpy(ls->name, name, DLM_LOCKSPACE_LEN);
+	ls->global_id = global_id(ls->name);
+	ls->minor = -1;
+	ls->control_fd = -1;
+	ls->config_fd = -1;
+	ls->stopped = node_mask(local_node);
+	INIT_LIST_HEAD(&ls->tree_rounds);
+	ls->next = lockspaces;
+	lockspaces = ls;
+	insert_lockspace(&lockspace_table, ls);
+	return ls;
+}
+
+/*
+ * POSIX aio completion notification, called on a helper thread.  Only wake up
+ * the event loop when the queue was empty; otherwise, a wakeup is already
+ * pending and the completion will be picked up along with the others.
+ */
+static void
+aio_notify(union sigval sv)
+{
+	struct aio_request *req = sv.sival_ptr;
+	const uint64_t one = 1;
+	int err;
+
+	err = aio_error(&req->aiocb);
+	if (err == 0 && aio_return(&req->aiocb) != req->nbytes)
+		err = EIO;
+	req->error = err;
+	if (mpsc_push(&aio_notified, &req->notified)) {
+		if (write(aio_notify_fd, &one, sizeof(one)) != sizeof(one))
+			fail(NULL);
+	}
+}
+
+/*
+ * Submit an asynchronous write.  Returns -1 with errno set on failure.
+ */
+static int
+submit_aio_request(struct aio_request *aio_req)
+{
+	if (ring.fd != -1) {
+		struct io_uring_sqe *sqe;
+
+		sqe = uring_get_sqe(&ring);
+		if (!sqe) {
+			if (uring_submit(&ring) == -1)
+				return -1;
+			sqe = uring_get_sqe(&ring);
+			if (!sqe) {
+				errno = EAGAIN;
+				return -1;
+			}
+		}
+		aio_req->iov.iov_base = (void *)aio_req->buf;
+		aio_req->iov.iov_len = aio_req->nbytes;
+		uring_prep_writev(sqe, aio_req->fd, &aio_req->iov, 1, 0, aio_req);
+		list_add(&aio_req->list, &aio_pending);
+		return 0;
+	}
+
+	memset(&aio_req->aiocb, 0, sizeof(aio_req->aiocb));
+	aio_req->aiocb.aio_sigevent.sigev_notify = SIGEV_THREAD;
+	aio_req->aiocb.aio_sigevent.sigev_notify_function = aio_notify;
+	aio_req->aiocb.aio_sigevent.sigev_value.sival_ptr = aio_req;
+	aio_req->aiocb.aio_fildes = aio_req->fd;
+	aio_req->aiocb.aio_nbytes = aio_req->nbytes;
+	aio_req->aiocb.aio_buf = (void *)aio_req->buf;
+	list_add(&aio_req->list, &aio_pending);
+	if (aio_write(&aio_req->aiocb) == 0)
+		return 0;
+	list_del(&aio_req->list);
+	return -1;
+}
+
+/*
+ * Completion of release_lockspace().
+ */
+static void
+complete_release(struct aio_request *aio_req)
+{
+	struct release_request *rel_req =
+		container_of(aio_req, struct release_request, aio_req);
+	struct dlm_write_request *req = &rel_req->req;
+
+	if (find_lockspace_by_minor(req->i.lspace.minor)) {
+		/*
+		 * Lockspaces are reference counted in the kernel.  The first
+		 * DLM_USER_CREATE_LOCKSPACE request creates a lockspace; the
+		 * last DLM_USER_REMOVE_LOCKSPACE request removes it.  Continue
+		 * removing the lockspace until it disappears.
+		 */
+		if (submit_aio_request(aio_req) == 0)
+			return;
+		fail(NULL);
+	}
+	pool_free(&release_request_pool, rel_req);
+}
+
+static void lockspace_offline_uevent(const char *name);
+
+/*
+ * Ask the kernel to release / remove a lockspace.  Lockspaces are reference
+ * counted and are only removed once their reference count drops to zero.
+ *
+ * The force parameter forces releasing a lockspace even when there are active
+ * locks; otherwise, releasing a lockspace with active locks fails with
+ * errno == EBUSY.
+ *
+ * Triggers an offline@/kernel/dlm/<name> uevent when the lockspace is removed
+ * which FakeDLM / dlm_controld the uses for leaving the lockspace cluster-wide
+ * and for removing its configuration.  When simulating, leave the lockspace
+ * directly instead.
+ */
+static void
+release_lockspace(struct lockspace *ls, bool force)
+{
+	struct release_request *rel_req;
+	struct aio_request *aio_req;
+	struct dlm_write_request *req;
+
+	if (simulate) {
+		if (node_in(ls->members, local_node))
+			lockspace_offline_uevent(ls->name);
+		return;
+	}
+	rel_req = pool_alloc(&release_request_pool);
+	req = &rel_req->req;
+	req->version[0] = DLM_DEVICE_VERSION_MAJOR;
+	req->version[1] = DLM_DEVICE_VERSION_MINOR;
+	req->version[2] = DLM_DEVICE_VERSION_PATCH;
+	req->cmd = DLM_USER_REMOVE_LOCKSPACE;
+	req->is64bit = sizeof(long) == sizeof(long long);
+	req->i.lspace.minor = ls->minor;
+	if (force)
+		req->i.lspace.flags = DLM_USER_LSFLG_FORCEFREE;
+
+	if (control_fd == -1) {
+		control_fd = open(DLM_CONTROL_PATH, O_RDWR);
+		if (control_fd == -1)
+			fail(DLM_CONTROL_PATH);
+	}
+
+	/* A normal write would block until the uevent has been marked as done.  */
+
+	aio_req = &rel_req->aio_req;
+	aio_req->fd = control_fd;
+	aio_req->buf = req;
+	aio_req->nbytes = sizeof(*req);
+	aio_req->complete = complete_release;
+	if (submit_aio_request(aio_req) == 0)
+		return;
+	fail(NULL);
+}
+
+static void
+release_lockspaces(bool force)
+{
+	struct lockspace *ls;
+
+	for (ls = lockspaces; ls; ls = ls->next)
+		release_lockspace(ls, force);
+}
+
+static void
+lockspace_status(struct lockspace *ls, const char *status)
+{
+	if (debug) {
+		printf("Lockspace %s %s: stopping=", ls->name, status);
+		print_nodes(stdout, ls->stopping);
+		printf(", stopped=");
+		print_nodes(stdout, ls->stopped);
+		printf(", joining=");
+		print_nodes(stdout, ls->joining);
+		printf(", leaving=");
+		print_nodes(stdout, ls->leaving);
+		printf(", members=");
+		print_nodes(stdout, ls->members);
+		printf(", epoch=%u\n", ls->epoch);
+		fflush(stdout);
+	}
+}
+
+/*
+ * Triggered to update the local configuration of a logspace once it has been
+ * stopped cluster-wide.  When the local node is joining a lockspace, add all
+ * lockspace members to the lockspace configuration including the local node.
+ * When the local node is leaving a lockspace, remove the entire lockspace
+ * configuration.  When the membership of the local node doesn't change, only
+ * add the joining and remove the leaving nodes.
+ *
+ * Once the configuration has been updated, start / restart the lockspace
+ * locally with:
+ *
+ *   echo 1 > /sys/kernel/dlm/<name>/control
+ *
+ * Requests for the local node to join or leave the lockspace are triggered by
+ * uevents which are completed by:
+ *
+ *   echo 0 > /sys/kernel/dlm/<name>/event_done
+ */
+/*
+ * Report the outcome of a lockspace online / offline uevent to the kernel.
+ */
+static void
+complete_uevent(struct lockspace *ls, unsigned int error)
+{
+	if (!simulate)
+		write_int_atf(dlm_sysfs_fd, error, "%s/event_done", ls->name);
+}
+
+/*
+ * Add the joining nodes to and remove the leaving nodes from the lockspace
+ * configuration in configfs.  The configuration is created when the local
+ * node joins, and removed when the local node leaves.
+ */
+static void
+configure_lockspace(struct lockspace *ls, node_mask_t joining,
+		    node_mask_t leaving)
+{
+	int nodeid;
+
+	if (node_in(ls->joining, local_node)) {
+		write_uint_atf(dlm_sysfs_fd, ls->global_id, "%s/id", ls->name);
+		if (local_node->nodir)
+			write_int_atf(dlm_sysfs_fd, 1, "%s/nodir", ls->name);
+		mkdiratf(spaces_fd, 0777, "%s", ls->name);
+		ls->config_fd = openatf(spaces_fd, O_PATH | O_DIRECTORY, "%s",
+					ls->name);
+		if (ls->config_fd == -1)
+			failf("%sspaces/%s", CONFIG_DLM_CLUSTER, ls->name);
+	}
+	for_each_nodeid(nodeid, joining) {
+		struct node *node = nodes_by_id[nodeid];
+
+		mkdiratf(ls->config_fd, 0777, "nodes/%d", node->nodeid);
+		write_int_atf(ls->config_fd, node->nodeid, "nodes/%d/nodeid",
+			      node->nodeid);
+		if (node->weight != 1)
+			write_int_atf(ls->config_fd, node->weight,
+				      "nodes/%d/weight", node->nodeid);
+	}
+	for_each_nodeid(nodeid, leaving) {
+		rmdiratf(ls->config_fd, "nodes/%d", nodeid);
+	}
+	if (node_in(ls->leaving, local_node)) {
+		close(ls->config_fd);
+		ls->config_fd = -1;
+		rmdiratf(spaces_fd, "%s", ls->name);
+	}
+}
+
+static void
+update_lockspace(struct lockspace *ls)
+{
+	node_mask_t joining = NO_NODES;
+	node_mask_t leaving = NO_NODES;
+	node_mask_t new_members;
+
+	if (node_in(ls->joining, local_node)) {
+		joining = mask_or(ls->members, ls->joining);
+	} else if (node_in(ls->members, local_node)) {
+		joining = ls->joining;
+	}
+	if (node_in(ls->leaving, local_node)) {
+		leaving = mask_or(ls->members, ls->leaving);
+	} else if (node_in(ls->members, local_node)) {
+		leaving = ls->leaving;
+	}
+	leaving = mask_andnot(leaving, joining);
+	if (!simulate)
+		configure_lockspace(ls, joining, leaving);
+	if (node_in(ls->joining, local_node)) {
+		joined_lockspaces++;
+	}
+	if (node_in(ls->leaving, local_node)) {
+		joined_lockspaces--;
+	}
+	new_members = mask_andnot(mask_or(ls->members, ls->joining),
+				  ls->leaving);
+	if (node_in(new_members, local_node)) {
+		/* (Re)start the kernel recovery daemon. */
+		if (ls->control_fd == -1) {
+			/*
+			 * When simulating, stopping and restarting still go
+			 * through the usual (asynchronous) writes.
+			 */
+			if (simulate)
+				ls->control_fd = open("/dev/null", O_WRONLY);
+			else
+				ls->control_fd = openatf(dlm_sysfs_fd, O_WRONLY,
+							 "%s/control", ls->name);
+			if (ls->control_fd == -1)
+				failf("%s/%s/control", DLM_SYSFS_DIR, ls->name);
+		}
+		if (write(ls->control_fd, "1", 1) != 1)
+			failf("%s/%s/control", DLM_SYSFS_DIR, ls->name);
+		mask_clear(&ls->stopped, local_node->nodeid);
+	}
+	if (node_in(mask_or(ls->joining, ls->leaving), local_node)) {
+		/* Complete the lockspace online / offline uevent. */
+		complete_uevent(ls, 0);
+	}
+	ls->members = new_members;
+	ls->stopping = NO_NODES;
+	ls->joining = NO_NODES;
+	ls->leaving = NO_NODES;
+	ls->announced = false;
+	ls->coordinating = false;
+	ls->coordinator = 0;
+	ls->epoch++;
+	lockspace_status(ls, "updated");
+}
+
+/*
+ * Has the local node started a round for the lockspace that is still waiting
+ * for the lockspace to stop cluster wide?
+ */
+static bool
+own_round_pending(struct lockspace *ls)
+{
+	return (node_in(mask_or(ls->joining, ls->leaving), local_node) &&
+		!ls->announced && !ls->coordinator) ||
+	       ls->evicting || ls->coordinating;
+}
+
+/*
+ * Membership changes are applied in recovery epochs: the joins and leaves of
+ * all rounds that overlap while a lockspace is stopped accumulate in
+ * ls->joining and ls->leaving, and are applied with a single configuration
+ * update and restart once the last of those rounds is over.  This way,
+ * several nodes joining at the same time cost one kernel recovery instead of
+ * one each.  A change we have asked a coordinator for ends with the
+ * coordinator's round.
+ */
+static void
+end_epoch(struct lockspace *ls)
+{
+	if (mask_intersects(ls->stopping, connected_nodes) ||
+	    own_round_pending(ls) || ls->coordinator)
+		return;
+	update_lockspace(ls);
+}
+
+/*
+ * Once a lockspace has stopped cluster wide, request to join or leave the
+ * lockspace on per nodes as required.  The local lockspace configuration is
+ * updated and the lockspace is restarted at the end of the epoch.
+ */
+static void
+lockspace_stopped(struct lockspace *ls)
+{
+	node_mask_t peers = mask_andnot(all_nodes, node_mask(local_node));
+
+	lockspace_status(ls, "stopped");
+	if (ls->coordinating) {
+		int nodeid;
+
+		/*
+		 * The result covers our own change and any eviction as well.
+		 * Peers that have told us they don't use the lockspace are
+		 * left out.
+		 */
+		for_each_nodeid(nodeid, mask_and(ls->round, round_peers(ls)))
+			send_membership(nodes_by_id[nodeid], ls);
+		ls->stopped = mask_andnot(ls->stopped, peers);
+		ls->coordinating = false;
+		ls->evicting = false;
+	} else if (!ls->coordinator) {
+		if (node_in(ls->joining, local_node) && !ls->announced) {
+			round_msg(MSG_JOIN_LOCKSPACE, ls, round_peers(ls));
+			ls->stopped = mask_andnot(ls->stopped, peers);
+		}
+		if (node_in(ls->leaving, local_node) && !ls->announced) {
+			round_msg(MSG_LEAVE_LOCKSPACE, ls, round_peers(ls));
+			ls->stopped = mask_andnot(ls->stopped, peers);
+		}
+	}
+	if (!ls->coordinator)
+		ls->announced = true;
+	if (ls->evicting) {
+		int nodeid;
+
+		/* Same path as the MSG_STOP_LOCKSPACE requests; see evict_node(). */
+		for_each_nodeid(nodeid, mask_and(ls->round, connected_nodes))
+			send_msg(nodes_by_id[nodeid], MSG_RESTART_LOCKSPACE, ls);
+		ls->stopped = mask_andnot(ls->stopped, peers);
+		ls->evicting = false;
+	}
+	end_epoch(ls);
+}
+
+static struct tree_round *
+find_tree_round(struct lockspace *ls, struct node *origin)
+{
+	struct tree_round *round;
+
+	list_for_each_entry(round, &ls->tree_rounds, list) {
+		if (round->origin == origin)
+			return round;
+	}
+	return NULL;
+}
+
+/*
+ * Once all connected nodes in our subtree have stopped a lockspace, pass that
+ * on to our parent and forget about the round.
+ */
+static void
+tree_round_check(struct lockspace *ls, struct tree_round *round)
+{
+	struct relay relay = {
+		.origin = round->origin,
+		.fanout = round->fanout,
+		.nodes = round->nodes,
+		.stopped = round->stopped,
+	};
+	struct node *parent;
+
+	if (!mask_subset(mask_and(round->subtree, connected_nodes),
+			 round->stopped))
+		return;
+	parent = tree_parent(&relay);
+	if (parent)
+		send_relay_msg(parent, MSG_LOCKSPACE_STOPPED, ls, &relay);
+	list_del(&round->list);
+	pool_free(&tree_round_pool, round);
+}
+
+/*
+ * Tell a node that the lockspace it asked us to stop has stopped here,
+ * either directly or through the spanning tree of its round.
+ */
+static void
+send_stopped(struct node *node, struct lockspace *ls)
+{
+	struct tree_round *round = find_tree_round(ls, node);
+
+	if (round) {
+		mask_set(&round->stopped, local_node->nodeid);
+		tree_round_check(ls, round);
+	} else if (scoped_peer(node)) {
+		/*
+		 * A node that starts a round after we have announced our own
+		 * hasn't seen our announcement, yet.
+		 */
+		if (!node_in(ls->members, local_node)) {
+			send_msg(node, MSG_LOCKSPACE_STOPPED, ls);
+			if (ls->announced && node_in(ls->joining, local_node))
+				send_msg(node, MSG_JOIN_LOCKSPACE, ls);
+		} else {
+			send_msg(node, MSG_MEMBER_STOPPED, ls);
+			if (ls->announced && node_in(ls->leaving, local_node))
+				send_msg(node, MSG_LEAVE_LOCKSPACE, ls);
+		}
+	} else {
+		send_msg(node, MSG_LOCKSPACE_STOPPED, ls);
+	}
+}
+
+/*
+ * Completion of stop_lockspace().
+ *
+ * If other nodes are waiting for the lockspace on this node to stop, notify
+ * them.  Once the lockspace has stopped cluster wide, update the logspace
+ * membership cluster-wide and restart the logspace with:
+ *
+ *   echo 1 > /sys/kernel/dlm/<name>/control
+ */
+static void
+complete_stop_lockspace(struct aio_request *aio_req)
+{
+	struct lockspace_aio_request *ls_aio_req =
+		container_of(aio_req, struct lockspace_aio_request, aio_req);
+	struct lockspace *ls = ls_aio_req->ls;
+	int nodeid;
+
+	mask_clear(&ls->stopping, local_node->nodeid);
+	for_each_nodeid(nodeid, ls->stopping)
+		send_stopped(nodes_by_id[nodeid], ls);
+	mask_set(&ls->stopped, local_node->nodeid);
+	if (own_round_pending(ls) && round_stopped(ls))
+		lockspace_stopped(ls);
+	else
+		end_epoch(ls);
+	pool_free(&stop_request_pool, ls_aio_req);
+}
+
+/*
+ * Request to stop a lockspace locally.
+ *
+ * Triggered by peer nodes.
+ *
+ * This can take a long time to complete, so use an asynchronous request.
+ *
+ * Essentially equivalent to:
+ *
+ *   echo 0 > /sys/kernel/dlm/<name>/control
+ */
+static void
+stop_lockspace(struct lockspace *ls)
+{
+	struct lockspace_aio_request *ls_aio_req;
+	struct aio_request *aio_req;
+
+	mask_set(&ls->stopping, local_node->nodeid);
+	ls_aio_req = pool_alloc(&stop_request_pool);
+	ls_aio_req->ls = ls;
+	aio_req = &ls_aio_req->aio_req;
+	aio_req->fd = ls->control_fd;
+	aio_req->buf = "0";
+	aio_req->nbytes = 1;
+	aio_req->complete = complete_stop_lockspace;
+	if (submit_aio_request(aio_req) == 0)
+		return;
+	failf("%s/%s/control", DLM_SYSFS_DIR, ls->name);
+}
+
+/*
+ * Run a round on behalf of the nodes that have asked us to change their
+ * membership (--coordinated), or extend the round already in progress to the
+ * nodes with new requests.  Unless we are a member, we don't know who uses
+ * the lockspace, so the round goes to all peers like the round of a joining
+ * node.
+ */
+static void
+coordinate_round(struct lockspace *ls)
+{
+	node_mask_t peers = mask_andnot(connected_nodes, node_mask(local_node));
+	int nodeid;
+
+	if (node_in(ls->members, local_node))
+		peers = round_peers(ls);
+	if (!ls->coordinating && !ls->evicting)
+		ls->round = NO_NODES;
+	ls->coordinating = true;
+	peers = mask_andnot(peers, ls->round);
+	ls->round = mask_or(ls->round, peers);
+	ls->stopped = mask_andnot(ls->stopped, peers);
+	/* Sent directly so that MSG_MEMBERSHIP can't overtake them. */
+	for_each_nodeid(nodeid, peers)
+		send_msg(nodes_by_id[nodeid], MSG_STOP_LOCKSPACE, ls);
+	if (!node_in(ls->stopped, local_node)) {
+		if (!node_in(ls->stopping, local_node))
+			stop_lockspace(ls);
+	} else if (round_stopped(ls)) {
+		lockspace_stopped(ls);
+	}
+}
+
+/*
+ * Hand our own membership change over to the lockspace's coordinator, which
+ * may be ourselves (--coordinated).  The coordinator may not keep track of
+ * the lockspace, so the request always includes the lockspace name.
+ */
+static void
+request_change(struct lockspace *ls)
+{
+	struct node *coordinator = lockspace_coordinator(ls);
+
+	if (coordinator == local_node) {
+		ls->coordinator = 0;
+		coordinate_round(ls);
+		return;
+	}
+	ls->coordinator = coordinator->nodeid;
+	mask_clear(&ls->name_sent, coordinator->nodeid);
+	send_msg(coordinator, node_in(ls->joining, local_node) ?
+			      MSG_JOIN_REQUEST : MSG_LEAVE_REQUEST, ls);
+}
+
+/*
+ * Request to add / join a lockspace.
+ *
+ * This event is triggered by DLM_USER_CREATE_LOCKSPACE requests by the user
+ * (via libdlm).
+ *
+ * Stop the lockspace on all nodes in the cluster, join the lockspace, and
+ * start the lockspace locally with:
+ *
+ *   echo 1 > /sys/kernel/dlm/<name>/control
+ *
+ * Complete the uevent with:
+ *
+ *   echo 0 > /sys/kernel/dlm/<name>/event_done
+ */
+static void
+lockspace_online_uevent(const char *name)
+{
+	struct lockspace *ls;
+
+	ls = find_lockspace(name);
+	if (!ls)
+		ls = new_lockspace(name);
+	if (!mask_equal(connected_nodes, all_nodes)) {
+		/* Refuse to create lockspaces when not fully connected. */
+		fprintf(stderr, "Not joining lockspace '%s': "
+			"not connected to node(s) ", name);
+		print_nodes(stderr, mask_andnot(all_nodes, connected_nodes));
+		fprintf(stderr, "\n");
+		fflush(stderr);
+		complete_uevent(ls, EBUSY);
+		return;
+	}
+	if (node_in(ls->members, local_node)) {
+		fprintf(stderr, "Already in lockspace '%s'\n", name);
+		fflush(stderr);
+		complete_uevent(ls, 0);
+		return;
+	}
+	printf("Joining lockspace '%s' [%04x]\n", ls->name, ls->global_id);
+	fflush(stdout);
+	/* (Lockspace not started, yet.) */
+	mask_set(&ls->joining, local_node->nodeid);
+	if (peers_capable(mask_andnot(connected_nodes, node_mask(local_node)),
+			  CAP_COORD)) {
+		request_change(ls);
+		return;
+	}
+	ls->round = mask_andnot(connected_nodes, node_mask(local_node));
+	if (!round_msg(MSG_STOP_LOCKSPACE, ls, ls->round))
+		update_lockspace(ls);
+}
+
+/*
+ * The control device for a new lockspace has been created.  Remember the new
+ * minor number assigned.
+ */
+static void
+lockspace_add_device_uevent(const char *buf, int len)
+{
+	const char *token = buf, *end = buf + len;
+	struct lockspace *ls;
+
+	ls = find_lockspace(buf);
+	if (!ls)
+		return;
+	while (token < end) {
+		const char *t;
+
+		t = memchr(token, 0, end - token);
+		if (!t)
+			break;
+		if (strncmp(token, "MINOR=", 6) == 0)
+			set_lockspace_minor(ls, atoi(token + 6));
+		token = t + 1;
+	}
+}
+
+/*
+ * Request to leave / remove a lockspace.
+ *
+ * This event is triggered by DLM_USER_REMOVE_LOCKSPACE requests, either by a
+ * user or by FakeDLM itself when shutting down or when we lose cluster
+ * connectivity (see release_lockspace()).  The lockspace is already stopped
+ * locally.
+ *
+ * Stop the lockspace on all nodes in the cluster, leave the lockspace, and
+ * then the lockspace locally be completing the uevent with:
+ *
+ *   echo 0 > /sys/kernel/dlm/<name>/event_done
+ */
+static void
+lockspace_offline_uevent(const char *name)
+{
+	struct lockspace *ls;
+	bool sent = false;
+
+	ls = find_lockspace(name);
+	if (!ls) {
+		printf("Lockspace '%s' doesn't exist\n",
+		       name);
+		return;
+	}
+	if (!node_in(ls->members, local_node)) {
+		printf("Not in lockspace '%s'\n", ls->name);
+		fflush(stdout);
+		return;
+	}
+	printf("Leaving lockspace '%s'\n", name);
+	fflush(stdout);
+
+	if (ls->control_fd != -1 && close(ls->control_fd) == -1)
+		failf("%s/%s/control", DLM_SYSFS_DIR, ls->name);
+	ls->control_fd = -1;
+	set_lockspace_minor(ls, -1);
+
+	mask_set(&ls->leaving, local_node->nodeid);
+	mask_set(&ls->stopped, local_node->nodeid);
+	if (mask_equal(connected_nodes, all_nodes)) {
+		if (peers_capable(mask_andnot(connected_nodes,
+					      node_mask(local_node)),
+				  CAP_COORD)) {
+			request_change(ls);
+			return;
+		}
+		ls->round = round_peers(ls);
+		sent = round_msg(MSG_STOP_LOCKSPACE, ls, ls->round);
+	}
+	if (!sent)
+		update_lockspace(ls);
+}
+
+static void
+udev_device_retry(struct timer *timer)
+{
+	struct udev_device *dev = container_of(timer, struct udev_device, timer);
+	int fd;
+
+	fd = open(dev->path, dev->flags);
+	if (fd == -1 && errno == ENOENT && dev->timeout >= dev->step) {
+		add_timer(&dev->timer, dev->step);
+		dev->timeout -= dev->step;
+		dev->step *= 2;
+		return;
+	}
+	dev->opened(dev, fd);
+}
+
+/*
+ * Repeatedly try opening a file until it gets created, with exponential
+ * backoff and a timeout (in milliseconds).  The retries are timer driven so
+ * that the event loop keeps running in the meantime.  Once the file has been
+ * opened or the timeout has expired, the opened callback is called with the
+ * file descriptor or -1.
+ */
+static void
+open_udev_device(struct udev_device *dev, const char *path, int flags,
+		 int timeout, void (*opened)(struct udev_device *, int))
+{
+	init_timer(&dev->timer, udev_device_retry);
+	dev->path = path;
+	dev->flags = flags;
+	dev->step = 10;
+	dev->timeout = timeout;
+	dev->opened = opened;
+	udev_device_retry(&dev->timer);
+}
+
+static void listen_to_uvents(void);
+static void configure_dlm(void);
+
+/*
+ * The kernel only lets us configure the DLM once the control daemon holds
+ * DLM_MONITOR_PATH open, so start configuring it and listening to its
+ * uevents from here.
+ */
+static void
+kernel_monitor_opened(struct udev_device *dev, int fd)
+{
+	if (fd == -1)
+		fail(DLM_MONITOR_PATH);
+	kernel_monitor_fd = fd;
+	listen_to_uvents();
+	configure_dlm();
+}
+
+/*
+ * The kernel expects the DLM control daemon (in this case FakeDLM) to keep
+ * DLM_MONITOR_PATH open while it is running.  This allows to detect when the
+ * control daemon dies unexpectedly.  When the dlm module still needs to be
+ * loaded, the device appears asynchronously; kernel_monitor_opened() then
+ * continues from the event loop.
+ */
+static void
+monitor_kernel(void)
+{
+	static struct udev_device kernel_monitor;
+	int fd;
+
+	fd = open(DLM_MONITOR_PATH, O_RDONLY);
+	if (fd != -1) {
+		kernel_monitor_opened(NULL, fd);
+		return;
+	}
+	if (access(CONFIG_DLM, X_OK) == -1) {
+		modprobe("dlm");
+		if (access(CONFIG_DLM, X_OK) == -1)
+			fail(CONFIG_DLM);
+	}
+	open_udev_device(&kernel_monitor, DLM_MONITOR_PATH, O_RDONLY, 5000,
+			 kernel_monitor_opened);
+}
+
+/*
+ * Build the table for looking up nodes by network address.  The table is at
+ * most half full, so probe sequences stay short.
+ */
+static void
+build_node_table(struct node_table *table, int count)
+{
+	unsigned int size = 4;
+	struct node *node;
+
+	while (size < 2 * count)
+		size *= 2;
+	table->slots = calloc(size, sizeof(*table->slots));
+	if (!table->slots)
+		fail(NULL);
+	table->mask = size - 1;
+	for (node = nodes; node; node = node->next) {
+		unsigned int n;
+
+		if (!node->addr)
+			continue;
+		n = addr_hash(node->addr->sa) & table->mask;
+
+		while (table->slots[n])
+			n = (n + 1) & table->mask;
+		table->slots[n] = node;
+	}
 }
 
-static struct lockspace *
-find_lockspace(const char *name)
+/*
+ * Create a list of node objects along with all the network addresses
+ * associated with each node.  Determine which of the nodes is local.
+ * Assign unique node IDs starting from 1.
+ */
+static void
+parse_nodes(char *node_names[], int count)
 {
+	struct node **last = &nodes;
+	int n, num = 0;
+
+	local_node = NULL;
+	for (n = 0; n < count; n++) {
+		struct node *node;
+
+		if (strcmp(node_names[n], "-") == 0)
+			continue;
+		if (n + 1 > MAX_NODES) {
+			fprintf(stderr, "Node %s: node IDs above %d are not "
+				"supported\n", node_names[n], MAX_NODES);
+			exit(2);
+		}
+		node = new_node(node_names[n]);
+		*last = node;
+		last = &node->next;
+		num++;
+
+		node->nodeid = n + 1;
+		if (local_nodeid ? node->nodeid == local_nodeid :
+				   is_local_addr(node->addr)) {
+			if (local_node) {
+				fprintf(stderr, "Nodes %s and %s are both "
+					"local", local_node->name, node->name);
+				exit(2);
+			}
+			local_node = node;
+		}
+		mask_set(&all_nodes, node->nodeid);
+		nodes_by_id[node->nodeid] = node;
+	}
+	if (!local_node) {
+		if (local_nodeid)
+			fprintf(stderr, "Node ID %d does not exist\n",
+				local_nodeid);
+		else
+			fprintf(stderr, "None of the specified nodes has a "
+				"local network address\n");
+		exit(2);
+	}
+	cluster_nodes = all_nodes;
+	mask_set(&connected_nodes, local_node->nodeid);
+	build_node_table(&node_table, num);
+}
+
+/*
+ * A node that is not a lockspace member has gone away, so it will not finish
+ * any round it has started and will not reply to ours.  Once no more rounds
+ * are pending, restart the lockspace.  If it was coordinating our own change,
+ * ask the new coordinator instead.
+ */
+static void
+forget_node(struct lockspace *ls, struct node *node)
+{
+	bool was_stopping = node_in(ls->stopping, node);
+
+	if (ls->coordinator == node->nodeid)
+		request_change(ls);
+
+	mask_clear(&ls->joining, node->nodeid);
+	mask_clear(&ls->stopping, node->nodeid);
+	mask_clear(&ls->stopped, node->nodeid);
+	if (own_round_pending(ls)) {
+		if (round_stopped(ls))
+			lockspace_stopped(ls);
+	} else if (was_stopping) {
+		end_epoch(ls);
+	}
+}
+
+/*
+ * Remove a failed node from all lockspaces and keep the lockspaces running on
+ * the surviving nodes (--evict).  All survivors in the eviction round mark the
+ * failed node as leaving; the coordinator (the connected member with the
+ * lowest node ID) then stops each affected lockspace and sends
+ * MSG_RESTART_LOCKSPACE, upon which they restart the lockspace without the
+ * failed node.
+ *
+ * The eviction round is sent directly on each peer's connection instead of by
+ * multicast or along a spanning tree so that the MSG_NODE_FAILED message
+ * always arrives first.
+ */
+static void
+evict_node(struct node *node)
+{
+	node_mask_t peers = mask_andnot(connected_nodes, node_mask(local_node));
 	struct lockspace *ls;
+	int nodeid;
 
+	printf("Evicting node %u\n", node->nodeid);
+	fflush(stdout);
+	for_each_nodeid(nodeid, peers) {
+		struct connection *conn = nodes_by_id[nodeid]->outgoing;
+
+		if (conn)
+			send_hdr_msg(conn, MSG_NODE_FAILED, node->nodeid);
+	}
 	for (ls = lockspaces; ls; ls = ls->next) {
-		if (strcmp(name, ls->name) == 0)
-			return ls;
+		struct node *coordinator;
+
+		if (ls->coordinator == node->nodeid)
+			request_change(ls);
+		if (!node_in(ls->members, node)) {
+			forget_node(ls, node);
+			continue;
+		}
+		coordinator = nodes_by_id[mask_first(mask_and(ls->members,
+							      connected_nodes))];
+		if (!node_in(mask_or(ls->members, ls->joining), local_node) &&
+		    coordinator && scoped_peer(coordinator)) {
+			/* We are not part of the eviction round. */
+			mask_clear(&ls->members, node->nodeid);
+			continue;
+		}
+		mask_clear(&ls->joining, node->nodeid);
+		mask_clear(&ls->stopping, node->nodeid);
+		mask_clear(&ls->stopped, node->nodeid);
+		mask_set(&ls->leaving, node->nodeid);
+		if (own_round_pending(ls)) {
+			/* That round will evict the node as well. */
+			if (round_stopped(ls))
+				lockspace_stopped(ls);
+			continue;
+		}
+		if (coordinator != local_node)
+			continue;
+		ls->evicting = true;
+		ls->round = round_peers(ls);
+		for_each_nodeid(nodeid, ls->round)
+			send_msg(nodes_by_id[nodeid], MSG_STOP_LOCKSPACE, ls);
+		if (!node_in(ls->stopped, local_node)) {
+			if (!node_in(ls->stopping, local_node))
+				stop_lockspace(ls);
+		} else if (round_stopped(ls)) {
+			lockspace_stopped(ls);
+		}
 	}
-	return NULL;
 }
 
-static uint32_t
-global_id(const char *name)
+/*
+ * A node that announced its departure (MSG_DEPART) has left all lockspaces
+ * and disconnected.  Until it comes back, the cluster consists of the
+ * remaining nodes.  Rounds relayed along a spanning tree keep the tree they
+ * were started with, and the majority needed for evicting failed nodes
+ * remains based on cluster_nodes.
+ */
+static void
+node_departed(struct node *node)
 {
-	char full_name[strlen(name) + 8];
+	struct lockspace *ls;
 
-	snprintf(full_name, sizeof(full_name), "dlm:ls:%s", name);
-	return cpgname_to_crc(full_name, strlen(full_name) + 1);
+	printf("Node %u has left the cluster\n", node->nodeid);
+	fflush(stdout);
+	mask_clear(&all_nodes, node->nodeid);
+	for (ls = lockspaces; ls; ls = ls->next)
+		forget_node(ls, node);
 }
 
 /*
- * Create a new lockspace in-memory object.
+ * Is the node a member of any lockspace?  With --coordinated, a departing
+ * node may disconnect before the coordinator's MSG_MEMBERSHIP with its leave
+ * has reached us.  When its leave request has reached us as the coordinator
+ * (ls->leaving), or the lockspace's coordinator has a round in progress, we
+ * wait for that message.
  */
-static struct lockspace *
-new_lockspace(const char *name)
+static bool
+lockspace_member(struct node *node)
 {
 	struct lockspace *ls;
 
-	ls = malloc(sizeof(*ls));
-	if (!ls)
-		fail(NULL);
-	memset(ls, 0, sizeof(*ls));
-	ls->name = strdup(name);
-	if (!ls->name)
-		fail(NULL);
-	ls->global_id = global_id(name);
-	ls->minor = -1;
-	ls->control_fd = -1;
-	ls->stopped = node_mask(local_node);
-	ls->next = lockspaces;
-	lockspaces = ls;
-	return ls;
+	for (ls = lockspaces; ls; ls = ls->next) {
+		if (coordinated && node_in(ls->members, node)) {
+			struct node *coordinator = lockspace_coordinator(ls);
+
+			if (node_in(ls->leaving, node) ||
+			    (coordinator != local_node &&
+			     node_in(ls->stopping, coordinator)))
+				continue;
+		}
+		if (node_in(mask_or(ls->members, ls->joining), node))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Stop holding back messages from a peer, and forget the messages held back
+ * so far.
+ */
+static void
+mcast_release(struct node *node)
+{
+	free(node->mcast_held);
+	node->mcast_held = NULL;
+	node->mcast_held_len = 0;
+	node->mcast_held_size = 0;
+	node->mcast_holding = false;
+}
+
+/*
+ * We have lost all connections to a peer node.  Unless we can evict the node
+ * (--evict), the cluster has degenerated and we shut all lockspaces down.
+ */
+static void
+node_lost(struct node *node)
+{
+	node_mask_t peers;
+	struct lockspace *ls;
+
+	mask_clear(&connected_nodes, node->nodeid);
+	del_timer(&node->heartbeat_timer);
+	node->rtt = 0;
+	node->srtt = 0;
+	node->mcast_synced = false;
+	mcast_release(node);
+	for (ls = lockspaces; ls; ls = ls->next) {
+		struct tree_round *round, *tmp;
+
+		list_for_each_entry_safe(round, tmp, &ls->tree_rounds, list) {
+			if (round->origin == node) {
+				list_del(&round->list);
+				pool_free(&tree_round_pool, round);
+			} else {
+				tree_round_check(ls, round);
+			}
+		}
+	}
+	if (node_in(departing_nodes, node)) {
+		mask_clear(&departing_nodes, node->nodeid);
+		if (!lockspace_member(node)) {
+			node_departed(node);
+			schedule_reconnect(node);
+			return;
+		}
+	}
+	peers = mask_andnot(connected_nodes, node_mask(local_node));
+	if (evict_failed &&
+	    mask_weight(connected_nodes) * 2 > mask_weight(cluster_nodes) &&
+	    peers_capable(peers, CAP_EVICT)) {
+		evict_node(node);
+		schedule_reconnect(node);
+		return;
+	}
+	for (ls = lockspaces; ls; ls = ls->next) {
+		ls->joining = NO_NODES;
+		ls->leaving = mask_andnot(ls->members, node_mask(local_node));
+		if (!mask_empty(ls->leaving))
+			update_lockspace(ls);
+		if (node_in(ls->members, local_node))
+			release_lockspace(ls, true);
+	}
+	schedule_reconnect(node);
+}
+
+/*
+ * A network connection should be closed because EOF was reached, an error
+ * occurred, or because a MSG_CLOSE message was received.  If the primary
+ * connection to a node is lost and there is no other connection to the node
+ * to switch to, the cluster has degenerated and we shut all lockspaces down.
+ */
+static void
+proto_close(struct connection *conn)
+{
+	struct node *node = conn->node;
+	bool outgoing = node->outgoing == conn;
+
+	free_connection(conn);
+	if (outgoing && !list_empty(&node->connections)) {
+		node->outgoing = list_first_entry(&node->connections,
+						  struct connection, list);
+		return;
+	}
+	if (outgoing)
+		node_lost(node);
+}
+
+/*
+ * Send a heartbeat or heartbeat acknowledgement.  The stamp of a heartbeat is
+ * echoed back in the acknowledgement.
+ */
+static void
+send_heartbeat(struct node *node, enum msg_type type, uint32_t stamp)
+{
+	struct connection *conn = node->outgoing;
+
+	if (conn && (conn->caps & CAP_HEARTBEAT))
+		send_hdr_msg(conn, type, stamp);
 }
 
 /*
- * Completion of release_lockspace().
+ * Send the next heartbeat to a peer node, or declare the node dead if it has
+ * been silent for too long.
  */
 static void
-complete_release(struct aio_request *aio_req)
+heartbeat_timeout(struct timer *timer)
 {
-	struct dlm_write_request *req = (void *)aio_req->aiocb.aio_buf;
-	struct lockspace *ls;
+	struct node *node = container_of(timer, struct node, heartbeat_timer);
+	struct connection *conn = node->outgoing;
+	uint64_t now = now_ms();
 
-	for (ls = lockspaces; ls; ls = ls->next) {
-		if (ls->minor == req->i.lspace.minor)
-			break;
-	}
-	if (ls) {
-		/*
-		 * Lockspaces are reference counted in the kernel.  The first
-		 * DLM_USER_CREATE_LOCKSPACE request creates a lockspace; the
-		 * last DLM_USER_REMOVE_LOCKSPACE request removes it.  Continue
-		 * removing the lockspace until it disappears.
-		 */
-		list_add(&aio_req->list, &aio_pending);
-		if (aio_write(&aio_req->aiocb) == 0)
+	if (!conn)
+		return;
+	if (conn->caps & CAP_HEARTBEAT) {
+		if (now - node->last_heard >= failure_timeout) {
+			fprintf(stderr, "%u: No response for %llu ms\n",
+				node->nodeid,
+				(unsigned long long)(now - node->last_heard));
+			close_connections(node);
+			node_lost(node);
 			return;
-		list_del(&aio_req->list);
-		fail(NULL);
+		}
+		send_heartbeat(node, MSG_HEARTBEAT, now_us());
 	}
-	free((void *)aio_req->aiocb.aio_buf);
-	free(aio_req);
+	if (conn->caps & CAP_MULTICAST)
+		mcast_announce(conn);
+	add_timer(timer, failure_timeout / HEARTBEATS_PER_TIMEOUT);
 }
 
+static int proto_parse_v2(struct connection *conn, const char *buf,
+			  unsigned int len);
+
 /*
- * Ask the kernel to release / remove a lockspace.  Lockspaces are reference
- * counted and are only removed once their reference count drops to zero.
- *
- * The force parameter forces releasing a lockspace even when there are active
- * locks; otherwise, releasing a lockspace with active locks fails with
- * errno == EBUSY.
- *
- * Triggers an offline@/kernel/dlm/<name> uevent when the lockspace is removed
- * which FakeDLM / dlm_controld the uses for leaving the lockspace cluster-wide
- * and for removing its configuration.
+ * Ask a peer node to retransmit the multicast packets we have missed.
  */
 static void
-release_lockspace(struct lockspace *ls, bool force)
+mcast_nack(struct node *node)
 {
-	struct aio_request *aio_req;
-	struct dlm_write_request *req;
-
-	req = malloc(sizeof(*req));
-	if (!req)
-		fail(NULL);
-	memset(req, 0, sizeof(*req));
-	req->version[0] = DLM_DEVICE_VERSION_MAJOR;
-	req->version[1] = DLM_DEVICE_VERSION_MINOR;
-	req->version[2] = DLM_DEVICE_VERSION_PATCH;
-	req->cmd = DLM_USER_REMOVE_LOCKSPACE;
-	req->is64bit = sizeof(long) == sizeof(long long);
-	req->i.lspace.minor = ls->minor;
-	if (force)
-		req->i.lspace.flags = DLM_USER_LSFLG_FORCEFREE;
-
-	if (control_fd == -1) {
-		control_fd = open(DLM_CONTROL_PATH, O_RDWR);
-		if (control_fd == -1)
-			fail(DLM_CONTROL_PATH);
-	}
-
-	/* A normal write would block until the uevent has been marked as done.  */
-
-	aio_req = malloc(sizeof(*aio_req));
-	if (!aio_req)
-		fail(NULL);
-	memset(aio_req, 0, sizeof(*aio_req));
-	aio_req->aiocb.aio_sigevent.sigev_notify = SIGEV_SIGNAL;
-	aio_req->aiocb.aio_sigevent.sigev_signo = SIGUSR1;
-	aio_req->aiocb.aio_sigevent.sigev_value.sival_ptr = aio_req;
-	aio_req->aiocb.aio_fildes = control_fd;
-	aio_req->aiocb.aio_nbytes = sizeof(*req);
-	aio_req->aiocb.aio_buf = req;
-	aio_req->complete = complete_release;
-	list_add(&aio_req->list, &aio_pending);
-	if (aio_write(&aio_req->aiocb) == 0)
+	if (node->mcast_nacked || !node->outgoing)
 		return;
-	list_del(&aio_req->list);
-	fail(NULL);
+	node->mcast_nacked = true;
+	send_hdr_msg(node->outgoing, MSG_MCAST_NACK, node->mcast_expected);
 }
 
+static void mcast_read(int fd, short revents, void *arg);
+
+/*
+ * A peer node has announced the sequence number of its next multicast
+ * packet.  The first announcement tells us where to start.  Later ones tell
+ * us which packets the peer's following messages depend on: pick up any
+ * packets that have arrived in the meantime, and hold back the following
+ * messages until the rest have been retransmitted.  When an earlier request
+ * for retransmission has not been answered by now, ask again.
+ */
 static void
-release_lockspaces(bool force)
+proto_mcast_seq(struct node *node, uint32_t seq)
 {
-	struct lockspace *ls;
-
-	for (ls = lockspaces; ls; ls = ls->next)
-		release_lockspace(ls, force);
+	if (!node->mcast_synced) {
+		node->mcast_synced = true;
+		node->mcast_expected = seq;
+		node->mcast_nacked = false;
+		return;
+	}
+	if (mcast_fd != -1 && (int32_t)(seq - node->mcast_expected) > 0)
+		mcast_read(mcast_fd, POLLIN, NULL);
+	if ((int32_t)(seq - node->mcast_expected) > 0) {
+		if (!node->mcast_holding ||
+		    (int32_t)(seq - node->mcast_hold) > 0)
+			node->mcast_hold = seq;
+		node->mcast_holding = true;
+		node->mcast_nacked = false;
+		mcast_nack(node);
+	}
 }
 
-static void
-lockspace_status(struct lockspace *ls, const char *status)
+/*
+ * Hold back a message received over TCP until the multicast packets it may
+ * depend on have arrived (see proto_mcast_seq()).  Heartbeats and multicast
+ * control messages are processed right away.  Returns the length of the
+ * message, or 0 if the message is incomplete.
+ */
+static int
+mcast_hold_msg(struct connection *conn, const char *buf, unsigned int len)
 {
-	if (debug) {
-		printf("Lockspace %s %s: stopping=", ls->name, status);
-		print_nodes(stdout, ls->stopping);
-		printf(", stopped=");
-		print_nodes(stdout, ls->stopped);
-		printf(", joining=");
-		print_nodes(stdout, ls->joining);
-		printf(", leaving=");
-		print_nodes(stdout, ls->leaving);
-		printf(", members=");
-		print_nodes(stdout, ls->members);
-		printf("\n");
-		fflush(stdout);
+	struct node *node = conn->node;
+	struct proto_hdr hdr;
+	unsigned int msg_len;
+
+	if (len < sizeof(hdr))
+		return 0;
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.msg == MSG_CLOSE ||
+	    (hdr.msg >= MSG_HEARTBEAT && hdr.msg <= MSG_MCAST_DATA))
+		return proto_parse_v2(conn, buf, len);
+	msg_len = ntohs(hdr.len);
+	if (msg_len < sizeof(hdr))
+		failf("Invalid message length %u received from node %u",
+		      msg_len, node->nodeid);
+	if (len < msg_len)
+		return 0;
+	if (node->mcast_held_len + msg_len > node->mcast_held_size) {
+		unsigned int size = node->mcast_held_size ?
+				    node->mcast_held_size : RECV_BUFFER_SIZE;
+
+		while (size < node->mcast_held_len + msg_len)
+			size *= 2;
+		node->mcast_held = realloc(node->mcast_held, size);
+		if (!node->mcast_held)
+			fail(NULL);
+		node->mcast_held_size = size;
 	}
+	memcpy(node->mcast_held + node->mcast_held_len, buf, msg_len);
+	node->mcast_held_len += msg_len;
+	return msg_len;
 }
 
 /*
- * Triggered to update the local configuration of a logspace once it has been
- * stopped cluster-wide.  When the local node is joining a lockspace, add all
- * lockspace members to the lockspace configuration including the local node.
- * When the local node is leaving a lockspace, remove the entire lockspace
- * configuration.  When the membership of the local node doesn't change, only
- * add the joining and remove the leaving nodes.
- *
- * Once the configuration has been updated, start / restart the lockspace
- * locally with:
- *
- *   echo 1 > /sys/kernel/dlm/<name>/control
- *
- * Requests for the local node to join or leave the lockspace are triggered by
- * uevents which are completed by:
- *
- *   echo 0 > /sys/kernel/dlm/<name>/event_done
+ * A peer node has asked us to retransmit our multicast packets starting from
+ * seq.  If we no longer have all of them, the peer has to start over with a
+ * new connection.
  */
 static void
-update_lockspace(struct lockspace *ls)
+proto_mcast_nack(struct node *node, uint32_t seq)
 {
-	node_mask_t joining = 0;
-	node_mask_t leaving = 0;
-	node_mask_t new_members;
-	struct node *node;
+	struct connection *conn = node->outgoing;
 
-	if (ls->joining & node_mask(local_node)) {
-		printf_pathf("%u", "%s/%s/id", ls->global_id, DLM_SYSFS_DIR, ls->name);
-		if (local_node->nodir)
-			printf_pathf("%d", "%s/%s/nodir", 1, DLM_SYSFS_DIR, ls->name);
-		mkdirf(0777, "%sspaces/%s", CONFIG_DLM_CLUSTER, ls->name);
-		joining = ls->members | ls->joining;
-	} else if (ls->members & node_mask(local_node)) {
-		joining = ls->joining;
-	}
-	if (ls->leaving & node_mask(local_node)) {
-		leaving = ls->members | ls->leaving;
-	} else if (ls->members & node_mask(local_node)) {
-		leaving = ls->leaving;
+	if (!conn)
+		return;
+	mcast_flush();
+	if (mcast_fd == -1 ||
+	    (int32_t)(mcast_seq - seq) < 0 ||
+	    mcast_seq - seq > MCAST_HISTORY) {
+		warn("Cannot retransmit multicast packet %u to node %u",
+		     seq, node->nodeid);
+		shutdown(conn->fd, SHUT_RDWR);
+		return;
 	}
-	for (node = nodes; node; node = node->next) {
-		if (joining & node_mask(node)) {
-			mkdirf(0777, "%sspaces/%s/nodes/%d", CONFIG_DLM_CLUSTER,
-			       ls->name, node->nodeid);
-			printf_pathf("%d", "%sspaces/%s/nodes/%d/nodeid", node->nodeid,
-				     CONFIG_DLM_CLUSTER, ls->name, node->nodeid);
-			if (node->weight != 1)
-				printf_pathf("%d", "%sspaces/%s/nodes/%d/weight",
-					     node->weight, CONFIG_DLM_CLUSTER,
-					     ls->name, node->nodeid);
-		} else if (leaving & node_mask(node)) {
-			rmdirf("%sspaces/%s/nodes/%d", CONFIG_DLM_CLUSTER,
-			       ls->name, node->nodeid);
+	for (; seq != mcast_seq; seq++) {
+		struct mcast_packet *packet = mcast_packet(seq);
+		struct proto_hdr hdr = {
+			.len = htons(sizeof(hdr) + packet->len),
+			.msg = MSG_MCAST_DATA,
+			.global_id = htonl(seq),
+		};
+
+		if (!flush_batch(conn) ||
+		    !queue_output(conn, &hdr, sizeof(hdr)) ||
+		    !queue_output(conn, packet->data, packet->len)) {
+			shutdown(conn->fd, SHUT_RDWR);
+			return;
 		}
 	}
-	if (ls->joining & node_mask(local_node)) {
-		joined_lockspaces++;
+}
+
+/*
+ * Process a multicast packet from a peer node, received by multicast or
+ * retransmitted over TCP.  Packets are processed in sequence number order:
+ * when a packet is missing, we ask for retransmission and drop everything
+ * until the missing packet arrives.  Once the packets a peer has announced
+ * have all arrived, the messages held back from it are processed.
+ */
+static void
+mcast_receive(struct connection *conn, uint32_t seq, const char *data,
+	      unsigned int len)
+{
+	struct node *node = conn->node;
+	unsigned int pos;
+
+	if (!node->mcast_synced || (int32_t)(seq - node->mcast_expected) < 0)
+		return;
+	if (seq != node->mcast_expected) {
+		mcast_nack(node);
+		return;
 	}
-	if (ls->leaving & node_mask(local_node)) {
-		joined_lockspaces--;
-		rmdirf("%sspaces/%s", CONFIG_DLM_CLUSTER, ls->name);
+	node->mcast_expected++;
+	node->mcast_nacked = false;
+	for (pos = 0; pos < len; ) {
+		int msg_len = proto_parse_v2(conn, data + pos, len - pos);
+
+		if (msg_len <= 0)
+			break;
+		pos += msg_len;
 	}
-	new_members = (ls->members | ls->joining) & ~ls->leaving;
-	if (new_members & node_mask(local_node)) {
-		/* (Re)start the kernel recovery daemon. */
-		if (ls->control_fd == -1) {
-			ls->control_fd = open_pathf(O_WRONLY, "%s/%s/control",
-						    DLM_SYSFS_DIR, ls->name);
-			if (ls->control_fd == -1)
-				failf("%s/%s/control", DLM_SYSFS_DIR, ls->name);
+	if (node->mcast_holding &&
+	    (int32_t)(node->mcast_expected - node->mcast_hold) >= 0) {
+		char *held = node->mcast_held;
+		unsigned int held_len = node->mcast_held_len;
+
+		/* Process the messages held back in the meantime. */
+		node->mcast_held = NULL;
+		mcast_release(node);
+		for (pos = 0; pos < held_len; ) {
+			int msg_len = proto_parse_v2(conn, held + pos,
+						     held_len - pos);
+
+			if (msg_len <= 0)
+				break;
+			pos += msg_len;
 		}
-		if (write(ls->control_fd, "1", 1) != 1)
-			failf("%s/%s/control", DLM_SYSFS_DIR, ls->name);
-		ls->stopped &= ~node_mask(local_node);
-	}
-	if ((ls->joining | ls->leaving) & node_mask(local_node)) {
-		/* Complete the lockspace online / offline uevent. */
-		printf_pathf("%d", "%s/%s/event_done", 0, DLM_SYSFS_DIR, ls->name);
+		free(held);
 	}
-	ls->members = new_members;
-	ls->stopping = 0;
-	ls->joining = 0;
-	ls->leaving = 0;
-	lockspace_status(ls, "updated");
 }
 
 /*
- * Once a lockspace has stopped cluster wide, request to join or leave the
- * lockspace on per nodes as required, update the local lockspace
- * configuration, and restart the lockspace.
+ * The multicast socket can be read from.
  */
 static void
-lockspace_stopped(struct lockspace *ls)
+mcast_read(int fd, short revents, void *arg)
 {
-	lockspace_status(ls, "stopped");
-	if (ls->joining & node_mask(local_node)) {
-		struct node *node;
+	char buf[MCAST_MTU];
+	struct sockaddr_storage ss;
 
-		for (node = nodes; node; node = node->next) {
-			if (node == local_node)
-				continue;
-			send_msg(node, MSG_JOIN_LOCKSPACE, ls->name);
-			ls->stopped &= ~node_mask(node);
-		}
-	}
-	if (ls->leaving & node_mask(local_node)) {
+	for(;;) {
+		socklen_t sa_len = sizeof(ss);
+		struct mcast_hdr hdr;
 		struct node *node;
+		ssize_t ret;
+		int nodeid;
 
-		for (node = nodes; node; node = node->next) {
-			if (node == local_node)
+		ret = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&ss,
+			       &sa_len);
+		if (ret == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if (errno == EINTR)
 				continue;
-			send_msg(node, MSG_LEAVE_LOCKSPACE, ls->name);
-			ls->stopped &= ~node_mask(node);
+			fail(NULL);
 		}
+		if (ret < sizeof(hdr))
+			continue;
+		memcpy(&hdr, buf, sizeof(hdr));
+		nodeid = ntohs(hdr.nodeid);
+		if (nodeid < 1 || nodeid > MAX_NODES)
+			continue;
+		node = nodes_by_id[nodeid];
+		if (!node || node == local_node || !node->outgoing ||
+		    !addr_equal((struct sockaddr *)&ss, node->addr->sa))
+			continue;
+		mcast_receive(node->outgoing, ntohl(hdr.seq), buf + sizeof(hdr),
+			      ret - sizeof(hdr));
 	}
-	update_lockspace(ls);
 }
 
 /*
- * Completion of stop_lockspace().
- *
- * If other nodes are waiting for the lockspace on this node to stop, notify
- * them.  Once the lockspace has stopped cluster wide, update the logspace
- * membership cluster-wide and restart the logspace with:
- *
- *   echo 1 > /sys/kernel/dlm/<name>/control
+ * A heartbeat acknowledgement has been received.
  */
 static void
-complete_stop_lockspace(struct aio_request *aio_req)
+proto_heartbeat_ack(struct node *node, uint32_t stamp)
 {
-	struct lockspace_aio_request *ls_aio_req =
-		container_of(aio_req, struct lockspace_aio_request, aio_req);
-	struct lockspace *ls = ls_aio_req->ls;
-	struct node *node;
+	node->rtt = (uint32_t)now_us() - stamp;
+	if (node->srtt)
+		node->srtt = (7 * node->srtt + node->rtt) / 8;
+	else
+		node->srtt = node->rtt ? node->rtt : 1;
+}
 
-	for (node = nodes; node; node = node->next) {
-		if (node == local_node)
-			continue;
-		if (ls->stopping & node_mask(node))
-			send_msg(node, MSG_LOCKSPACE_STOPPED, ls->name);
-	}
-	ls->stopping &= ~node_mask(local_node);
-	ls->stopped |= node_mask(local_node);
-	if (!(~ls->stopped & connected_nodes))
+/*
+ * A MSG_LOCKSPACE_STOPPED message has been received; the lockspace on the
+ * sending node has been stopped (or was already stopped) and will remain
+ * stopped until we send a MSG_JOIN_LOCKSPACE or MSG_LEAVE_LOCKSPACE message.
+ */
+static void
+proto_lockspace_stopped(struct node *node, struct lockspace *ls)
+{
+	mask_set(&ls->stopped, node->nodeid);
+	if (own_round_pending(ls) && round_stopped(ls))
 		lockspace_stopped(ls);
-	free(ls_aio_req);
 }
 
 /*
- * Request to stop a lockspace locally.
- *
- * Triggered by peer nodes.
- *
- * This can take a long time to complete, so use an asynchronous request.
- *
- * Essentially equivalent to:
- *
- *   echo 0 > /sys/kernel/dlm/<name>/control
+ * A MSG_STOP_LOCKSPACE message has been received.  (The lockspace is created
+ * when it doesn't exist, yet.)
  */
 static void
-stop_lockspace(struct lockspace *ls)
+proto_stop_lockspace(struct node *node, struct lockspace *ls)
 {
-	struct lockspace_aio_request *ls_aio_req;
-	struct aio_request *aio_req;
-
-	ls->stopping |= node_mask(local_node);
-	ls_aio_req = malloc(sizeof(*ls_aio_req));
-	if (!ls_aio_req)
-		fail(NULL);
-	memset(ls_aio_req, 0, sizeof(*ls_aio_req));
-	ls_aio_req->ls = ls;
-	aio_req = &ls_aio_req->aio_req;
-	aio_req->aiocb.aio_sigevent.sigev_notify = SIGEV_SIGNAL;
-	aio_req->aiocb.aio_sigevent.sigev_signo = SIGUSR1;
-	aio_req->aiocb.aio_sigevent.sigev_value.sival_ptr = aio_req;
-	aio_req->aiocb.aio_fildes = ls->control_fd;
-	aio_req->aiocb.aio_nbytes = 1;
-	aio_req->aiocb.aio_buf = "0";
-	aio_req->complete = complete_stop_lockspace;
-	list_add(&aio_req->list, &aio_pending);
-	if (aio_write(&aio_req->aiocb) == 0)
+	if (scoped_peer(node) &&
+	    !node_in(mask_or(ls->members, ls->joining), local_node)) {
+		send_unused(node, ls->global_id);
 		return;
-	list_del(&aio_req->list);
-	failf("%s/%s/control", DLM_SYSFS_DIR, ls->name);
+	}
+	/*
+	 * The lockspace will not be restarted until all bits in ls->stopping
+	 * (one for each peer node) have been cleared again.
+	 */
+	mask_set(&ls->stopping, node->nodeid);
+	/*
+	 * The ls->stopped bit for the local node indicates whether the
+	 * lockspace is active or stopped locally; new lockspaces start out
+	 * stopped.  The ls->stopping bit for the local node indicates whether
+	 * we have already requested the kernel to stop the lockspace locally.
+	 */
+	if (node_in(ls->stopped, local_node))
+		send_stopped(node, ls);
+	else if (!node_in(ls->stopping, local_node))
+		stop_lockspace(ls);
 }
 
 /*
- * Request to add / join a lockspace.
- *
- * This event is triggered by DLM_USER_CREATE_LOCKSPACE requests by the user
- * (via libdlm).
- *
- * Stop the lockspace on all nodes in the cluster, join the lockspace, and
- * start the lockspace locally with:
- *
- *   echo 1 > /sys/kernel/dlm/<name>/control
- *
- * Complete the uevent with:
- *
- *   echo 0 > /sys/kernel/dlm/<name>/event_done
+ * A MSG_JOIN_LOCKSPACE message has been received.
  */
 static void
-lockspace_online_uevent(const char *name)
+proto_join_lockspace(struct node *node, struct lockspace *ls)
 {
-	struct lockspace *ls;
-	struct node *node;
-	bool sent = false;
-
-	ls = find_lockspace(name);
-	if (!ls)
-		ls = new_lockspace(name);
-	if (connected_nodes != all_nodes) {
-		/* Refuse to create lockspaces when not fully connected. */
-		fprintf(stderr, "Not joining lockspace '%s': "
-			"not connected to node(s) ", name);
-		print_nodes(stderr, all_nodes & ~connected_nodes);
-		fprintf(stderr, "\n");
-		fflush(stderr);
-		printf_pathf("%d", "%s/%s/event_done", EBUSY, DLM_SYSFS_DIR, ls->name);
-		return;
-	}
-	if (ls->members & node_mask(local_node)) {
-		fprintf(stderr, "Already in lockspace '%s'\n", name);
-		fflush(stderr);
-		printf_pathf("%d", "%s/%s/event_done", 0, DLM_SYSFS_DIR, ls->name);
+	if (node_in(ls->members, node)) {
+		warn("MSG_LEAVE_LOCKSPACE: Node %u already is a member",
+		     node->nodeid);
 		return;
 	}
-	printf("Joining lockspace '%s' [%04x]\n", ls->name, ls->global_id);
-	fflush(stdout);
-	/* (Lockspace not started, yet.) */
-	ls->joining |= node_mask(local_node);
-	for (node = nodes; node; node = node->next) {
-		if (node == local_node)
-			continue;
-		sent |= send_msg(node, MSG_STOP_LOCKSPACE, name);
+	mask_set(&ls->joining, node->nodeid);
+	mask_clear(&ls->stopping, node->nodeid);
+	end_epoch(ls);
+}
+
+/*
+ * A MSG_LEAVE_LOCKSPACE  message has been received.
+ */
+static void
+proto_leave_lockspace(struct node *node, struct lockspace *ls)
+{
+	if (!node_in(ls->members, node)) {
+		warn("MSG_LEAVE_LOCKSPACE: Node %u is not a member",
+		     node->nodeid);
+		return;
 	}
-	if (!sent)
-		update_lockspace(ls);
+	mask_set(&ls->leaving, node->nodeid);
+	mask_clear(&ls->stopping, node->nodeid);
+	end_epoch(ls);
 }
 
 /*
- * The control device for a new lockspace has been created.  Remember the new
- * minor number assigned.
+ * A MSG_RESTART_LOCKSPACE message has been received.
  */
 static void
-lockspace_add_device_uevent(const char *buf, int len)
+proto_restart_lockspace(struct node *node, struct lockspace *ls)
 {
-	const char *token = buf, *end = buf + len;
-	struct lockspace *ls;
-
-	ls = find_lockspace(buf);
-	if (!ls)
+	if (!node_in(ls->stopping, node)) {
+		warn("MSG_RESTART_LOCKSPACE: Node %u has not stopped the "
+		     "lockspace", node->nodeid);
 		return;
-	while (token < end) {
-		const char *t;
+	}
+	mask_clear(&ls->stopping, node->nodeid);
+	end_epoch(ls);
+}
 
-		t = memchr(token, 0, end - token);
-		if (!t)
-			break;
-		if (strncmp(token, "MINOR=", 6) == 0)
-			ls->minor = atoi(token + 6);
-		token = t + 1;
+/*
+ * A node has asked us to coordinate its joining or leaving a lockspace
+ * (--coordinated).  Each node knows best whether it is a member, so our view
+ * is corrected if necessary.  A joining node that has already answered our
+ * round with MSG_LOCKSPACE_UNUSED is asked to stop again, this time on our
+ * behalf.
+ */
+static void
+proto_change_request(struct node *node, struct lockspace *ls, bool join)
+{
+	if (join) {
+		mask_clear(&ls->members, node->nodeid);
+		mask_set(&ls->joining, node->nodeid);
+		if (node_in(ls->stopped, node))
+			mask_clear(&ls->round, node->nodeid);
+	} else {
+		mask_set(&ls->members, node->nodeid);
+		mask_set(&ls->leaving, node->nodeid);
 	}
+	coordinate_round(ls);
 }
 
 /*
- * Request to leave / remove a lockspace.
- *
- * This event is triggered by DLM_USER_REMOVE_LOCKSPACE requests, either by a
- * user or by FakeDLM itself when shutting down or when we lose cluster
- * connectivity (see release_lockspace()).  The lockspace is already stopped
- * locally.
- *
- * Stop the lockspace on all nodes in the cluster, leave the lockspace, and
- * then the lockspace locally be completing the uevent with:
- *
- *   echo 0 > /sys/kernel/dlm/<name>/event_done
+ * A MSG_MEMBERSHIP message has been received from a coordinator.  Unless we
+ * are a member, we learn the members from it.  Changes of nodes that are
+ * waiting for a round of their own were applied by the coordinator's round,
+ * which can happen when the nodes briefly disagree about the coordinator.
  */
 static void
-lockspace_offline_uevent(const char *name)
+proto_membership(struct node *node, const char *name, uint32_t id,
+		 const struct membership *m)
 {
 	struct lockspace *ls;
-	struct node *node;
-	bool sent = false;
+	node_mask_t changes;
 
-	ls = find_lockspace(name);
+	ls = name ? find_lockspace(name) : find_lockspace_by_id(id);
+	if (verbose) {
+		printf("< %u %s %s\n", node->nodeid, msg_name(MSG_MEMBERSHIP),
+		       ls ? ls->name : name ? name : "?");
+		fflush(stdout);
+	}
 	if (!ls) {
-		printf("Lockspace '%s' doesn't exist\n",
-		       name);
+		warn("MSG_MEMBERSHIP: Node %u referenced unknown lockspace %08x",
+		     node->nodeid, id);
 		return;
 	}
-	if (!(ls->members & node_mask(local_node))) {
-		printf("Not in lockspace '%s'\n", ls->name);
-		fflush(stdout);
+	if (!node_in(ls->stopping, node)) {
+		warn("MSG_MEMBERSHIP: Node %u has not stopped the lockspace",
+		     node->nodeid);
 		return;
 	}
-	printf("Leaving lockspace '%s'\n", name);
-	fflush(stdout);
-
-	if (ls->control_fd != -1 && close(ls->control_fd) == -1)
-		failf("%s/%s/control", DLM_SYSFS_DIR, ls->name);
-	ls->control_fd = -1;
-	ls->minor = -1;
-
-	ls->leaving |= node_mask(local_node);
-	ls->stopped |= node_mask(local_node);
-	if (connected_nodes == all_nodes) {
-		for (node = nodes; node; node = node->next) {
-			if (node == local_node)
-				continue;
-			sent |= send_msg(node, MSG_STOP_LOCKSPACE, name);
-		}
+	if (!node_in(ls->members, local_node))
+		ls->members = mask_and(m->members, all_nodes);
+	ls->joining = mask_or(ls->joining,
+			      mask_andnot(mask_and(m->joining, all_nodes),
+					  ls->members));
+	ls->leaving = mask_or(ls->leaving, mask_and(m->leaving, ls->members));
+	changes = mask_or(m->joining, m->leaving);
+	if (node_in(changes, local_node)) {
+		ls->coordinator = 0;
+		ls->announced = true;
 	}
-	if (!sent)
-		update_lockspace(ls);
+	ls->stopping = mask_andnot(ls->stopping,
+				   mask_andnot(changes, node_mask(local_node)));
+	mask_clear(&ls->stopping, node->nodeid);
+	end_epoch(ls);
 }
 
 /*
- * Repeatedly try opening a file until it gets created, with exponential
- * backoff and a timeout (in microseconds).
+ * A peer node has reported another node as failed.  Unless we have noticed
+ * already, follow suit.
  */
-static int
-open_udev_device(const char *path, int flags, int timeout)
+static void
+proto_node_failed(struct node *node, uint32_t nodeid)
 {
-	int fd, step = 10000;
+	struct node *failed;
 
-	fd = open(path, flags);
-	while (fd == -1 && errno == ENOENT && timeout >= step) {
-		usleep(step);
-		timeout -= step;
-		step *= 2;
-		fd = open(path, flags);
-	}
-	return fd;
+	if (nodeid < 1 || nodeid > MAX_NODES)
+		return;
+	failed = nodes_by_id[nodeid];
+	if (!failed || failed == local_node || !node_in(connected_nodes, failed))
+		return;
+	printf("Node %u reports node %u as failed\n", node->nodeid, nodeid);
+	fflush(stdout);
+	close_connections(failed);
+	node_lost(failed);
 }
 
 /*
- * The kernel expects the DLM control daemon (in this case FakeDLM) to keep
- * DLM_MONITOR_PATH open while it is running.  This allows to detect when the
- * control daemon dies unexpectedly.
+ * A peer node has announced that it is shutting down.
  */
 static void
-monitor_kernel(void)
+proto_depart(struct node *node)
 {
-	kernel_monitor_fd = open_udev_device(DLM_MONITOR_PATH, O_RDONLY, 0);
-	if (kernel_monitor_fd != -1)
+	printf("Node %u is leaving the cluster\n", node->nodeid);
+	fflush(stdout);
+	mask_set(&departing_nodes, node->nodeid);
+}
+
+/*
+ * A digest received from a peer node says that it is (or isn't) a member of a
+ * lockspace, and it knows best.  If we are a member ourselves, the lockspace
+ * needs to be stopped and reconfigured locally; a round already in progress
+ * will take care of that as well.  Otherwise, only our view needs fixing.
+ */
+static void
+resync_member(struct lockspace *ls, struct node *node, bool member)
+{
+	node_mask_t pending = mask_or(ls->stopping,
+				      mask_or(ls->joining, ls->leaving));
+
+	if (node_in(ls->members, node) == member || node_in(pending, node))
+		return;
+	printf("Lockspace %s: node %u is %sa member\n", ls->name, node->nodeid,
+	       member ? "" : "no longer ");
+	fflush(stdout);
+	if (!node_in(ls->members, local_node)) {
+		if (member)
+			mask_set(&ls->members, node->nodeid);
+		else
+			mask_clear(&ls->members, node->nodeid);
 		return;
-	if (access(CONFIG_DLM, X_OK) == -1) {
-		modprobe("dlm");
-		if (access(CONFIG_DLM, X_OK) == -1)
-			fail(CONFIG_DLM);
 	}
-	kernel_monitor_fd = open_udev_device(DLM_MONITOR_PATH, O_RDONLY, 5000000);
-	if (kernel_monitor_fd == -1)
-		fail(DLM_MONITOR_PATH);
+	mask_set(member ? &ls->joining : &ls->leaving, node->nodeid);
+	if (!node_in(ls->stopped, local_node)) {
+		if (!node_in(ls->stopping, local_node))
+			stop_lockspace(ls);
+	} else {
+		end_epoch(ls);
+	}
 }
 
 /*
- * Create a list of node objects along with all the network addresses
- * associated with each node.  Determine which of the nodes is local.
- * Assign unique node IDs starting from 1.
+ * A MSG_DIGEST message has been received.  With scoped peers (CAP_SCOPED),
+ * only the lockspaces we use or are joining are reconciled; otherwise,
+ * lockspaces we don't know about yet are created with the members the peer
+ * node has seen.
  */
 static void
-parse_nodes(char *node_names[], int count)
+proto_digest(struct node *node, const char *buf, unsigned int len)
 {
-	struct node **last = &nodes;
-	int n;
+	unsigned int pos = 0, count = 0;
 
-	local_node = NULL;
-	for (n = 0; n < count; n++) {
-		struct node *node;
+	while (pos < len) {
+		char name[DLM_LOCKSPACE_LEN + 1];
+		struct proto_digest entry;
+		node_mask_t members = NO_NODES;
+		struct lockspace *ls;
+		unsigned int n;
 
-		if (strcmp(node_names[n], "-") == 0)
-			continue;
-		node = new_node(node_names[n]);
-		*last = node;
-		last = &node->next;
+		if (len - pos < sizeof(entry))
+			break;
+		memcpy(&entry, buf + pos, sizeof(entry));
+		pos += sizeof(entry);
+		if (entry.name_len > DLM_LOCKSPACE_LEN ||
+		    len - pos < entry.mask_words * 8 + entry.name_len)
+			break;
+		for (n = 0; n < entry.mask_words; n++, pos += 8) {
+			uint64_t word;
 
-		node->nodeid = n + 1;
-		if (is_local_addr(node->addr)) {
-			if (local_node) {
-				fprintf(stderr, "Nodes %s and %s are both "
-					"local", local_node->name, node->name);
-				exit(2);
+			memcpy(&word, buf + pos, sizeof(word));
+			if (n < NODE_MASK_WORDS)
+				members.w[n] = be64toh(word);
+		}
+		members = mask_and(members, all_nodes);
+		memcpy(name, buf + pos, entry.name_len);
+		name[entry.name_len] = 0;
+		pos += entry.name_len;
+		count++;
+
+		if (entry.name_len) {
+			ls = find_lockspace(name);
+			if (!ls && !scoped_peer(node)) {
+				ls = new_lockspace(name);
+				ls->members = mask_andnot(members,
+							  node_mask(local_node));
 			}
-			local_node = node;
+		} else {
+			ls = find_lockspace_by_id(ntohl(entry.global_id));
+			if (!ls && !scoped_peer(node))
+				warn("%s: Node %u referenced unknown lockspace "
+				     "%08x", msg_name(MSG_DIGEST), node->nodeid,
+				     ntohl(entry.global_id));
 		}
-		all_nodes |= node_mask(node);
+		/* We don't keep track of lockspaces we don't use. */
+		if (!ls || (scoped_peer(node) &&
+			    !node_in(mask_or(ls->members, ls->joining),
+				     local_node)))
+			continue;
+		mask_set(&ls->digest_seen, node->nodeid);
+		if (!mask_equal(ls->members, members))
+			resync_member(ls, node, true);
 	}
-	if (!local_node) {
-		fprintf(stderr, "None of the specified nodes has a local "
-			"network address\n");
-		exit(2);
+	if (pos != len)
+		failf("Invalid digest received from node %u", node->nodeid);
+	if (verbose) {
+		printf("< %u %s (%u lockspaces)\n", node->nodeid,
+		       msg_name(MSG_DIGEST), count);
+		fflush(stdout);
 	}
-	connected_nodes |= node_mask(local_node);
 }
 
 /*
- * A network connection should be closed because EOF was reached, an error
- * occurred, or because a MSG_CLOSE message was received.  If the primary
- * connection to a node is lost, the cluster has degenerated and we shut
- * all lockspaces down.
+ * A peer node's digest is complete; it is not a member of any of the
+ * lockspaces it hasn't listed.
  */
 static void
-proto_close(int fd, struct node *node)
+proto_digest_end(struct node *node)
 {
-	close(fd);
-	remove_poll_callback(&cbs, fd);
-	if (node->outgoing_fd == fd) {
-		struct lockspace *ls;
+	struct lockspace *ls;
 
-		node->outgoing_fd = -1;
-		connected_nodes &= ~node_mask(node);
-		for (ls = lockspaces; ls; ls = ls->next) {
-			ls->joining = 0;
-			ls->leaving = ls->members & ~node_mask(local_node);
-			if (ls->leaving)
-				update_lockspace(ls);
-			if (ls->members & node_mask(local_node))
-				release_lockspace(ls, true);
-		}
+	for (ls = lockspaces; ls; ls = ls->next) {
+		if (node_in(ls->digest_seen, node))
+			mask_clear(&ls->digest_seen, node->nodeid);
+		else if (node_in(ls->members, node) &&
+			 (!scoped_peer(node) ||
+			  node_in(mask_or(ls->members, ls->joining), local_node)))
+			resync_member(ls, node, false);
 	}
 }
 
 /*
- * A MSG_LOCKSPACE_STOPPED message has been received; the lockspace on the
- * sending node has been stopped (or was already stopped) and will remain
- * stopped until we send a MSG_JOIN_LOCKSPACE or MSG_LEAVE_LOCKSPACE message.
+ * A message relayed along a spanning tree has been received.  Requests are
+ * forwarded down the tree and then handled as if the root had sent them
+ * directly; MSG_LOCKSPACE_STOPPED replies are collected on their way up.
  */
 static void
-proto_lockspace_stopped(struct node *node, const char *name)
+proto_relay_msg(enum msg_type type, struct lockspace *ls,
+		const struct relay *relay)
 {
-	struct lockspace *ls;
-
-	ls = find_lockspace(name);
-	if (!ls)
-		return;
-	ls->stopped |= node_mask(node);
-	if (!(~ls->stopped & connected_nodes))
-		lockspace_stopped(ls);
+	struct tree_round *round;
+
+	switch(type) {
+	case MSG_STOP_LOCKSPACE:
+		round = find_tree_round(ls, relay->origin);
+		if (!round) {
+			round = pool_alloc(&tree_round_pool);
+			round->origin = relay->origin;
+			list_add_tail(&round->list, &ls->tree_rounds);
+		}
+		round->fanout = relay->fanout;
+		round->nodes = relay->nodes;
+		round->subtree =
+			tree_subtree(relay, tree_pos(relay, local_node->nodeid));
+		round->stopped = NO_NODES;
+		tree_forward(type, ls, relay);
+		proto_stop_lockspace(relay->origin, ls);
+		break;
+
+	case MSG_LOCKSPACE_STOPPED:
+		if (relay->origin == local_node) {
+			ls->stopped = mask_or(ls->stopped, relay->stopped);
+			if (own_round_pending(ls) && round_stopped(ls))
+				lockspace_stopped(ls);
+			break;
+		}
+		round = find_tree_round(ls, relay->origin);
+		if (!round) {
+			warn("MSG_LOCKSPACE_STOPPED: No round of node %u",
+			     relay->origin->nodeid);
+			break;
+		}
+		round->stopped = mask_or(round->stopped, relay->stopped);
+		tree_round_check(ls, round);
+		break;
+
+	case MSG_JOIN_LOCKSPACE:
+		tree_forward(type, ls, relay);
+		proto_join_lockspace(relay->origin, ls);
+		break;
+
+	case MSG_LEAVE_LOCKSPACE:
+		tree_forward(type, ls, relay);
+		proto_leave_lockspace(relay->origin, ls);
+		break;
+
+	default:
+		break;
+	}
 }
 
 /*
- * A MSG_STOP_LOCKSPACE message has been received.
+ * A HELLO or HELLO_ACK has been received.  Once we know that the peer
+ * understands the new format, we acknowledge its HELLO and switch to the
+ * common protocol version for sending; the peer's HELLO_ACK tells us that it
+ * has switched as well.
  */
 static void
-proto_stop_lockspace(struct node *node, const char *name)
+proto_hello(struct connection *conn, const struct proto_hello *hello)
 {
-	struct lockspace *ls;
-
-	ls = find_lockspace(name);
-	if (!ls)
-		ls = new_lockspace(name);
-	/*
-	 * The lockspace will not be restarted until all bits in ls->stopping
-	 * (one for each peer node) have been cleared again.
-	 */
-	ls->stopping |= node_mask(node);
-	/*
-	 * The ls->stopped bit for the local node indicates whether the
-	 * lockspace is active or stopped locally; new lockspaces start out
-	 * stopped.  The ls->stopping bit for the local node indicates whether
-	 * we have already requested the kernel to stop the lockspace locally.
-	 */
-	if (ls->stopped & node_mask(local_node))
-		send_msg(node, MSG_LOCKSPACE_STOPPED, ls->name);
-	else if (!(ls->stopping & node_mask(local_node)))
-		stop_lockspace(ls);
+	if (verbose) {
+		printf("< %u %s version %u caps %x\n", conn->node->nodeid,
+		       hello->type == HELLO ? "HELLO" : "HELLO_ACK",
+		       hello->version, ntohl(hello->caps));
+		fflush(stdout);
+	}
+	switch(hello->type) {
+	case HELLO:
+		if (hello->version < 2)
+			break;
+		conn->caps = local_caps() & ntohl(hello->caps);
+		send_hello(conn, HELLO_ACK);
+		conn->send_v2 = conn->caps & CAP_GLOBAL_ID;
+		if (conn->send_v2 && (conn->caps & CAP_MULTICAST))
+			mcast_announce(conn);
+		if (conn->send_v2 && (conn->caps & CAP_DIGEST) &&
+		    conn == conn->node->outgoing)
+			send_digest(conn);
+		break;
+
+	case HELLO_ACK:
+		conn->recv_v2 = conn->caps & CAP_GLOBAL_ID;
+		break;
+	}
 }
 
 /*
- * A MSG_JOIN_LOCKSPACE message has been received.
+ * Process a message received from a peer node.  The lockspace is identified by
+ * name when the peer includes it, and by global_id otherwise.  Returns false
+ * when the connection has been closed.
  */
-static void
-proto_join_lockspace(struct node *node, const char *name)
+static bool
+proto_msg(struct connection *conn, enum msg_type type, const char *name,
+	  uint32_t id, const struct relay *relay)
 {
-	struct lockspace *ls;
+	struct node *node = conn->node;
+	struct lockspace *ls = NULL;
 
-	ls = find_lockspace(name);
-	if (!ls)
-		return;
-	if (ls->members & node_mask(node)) {
-		warn("MSG_LEAVE_LOCKSPACE: Node %u already is a member",
-		     node->nodeid);
-		return;
+	if (type == MSG_CLOSE) {
+		if (verbose) {
+			printf("< %u %s\n", node->nodeid, msg_name(type));
+			fflush(stdout);
+		}
+		proto_close(conn);
+		return false;
 	}
-	ls->joining |= node_mask(node);
-	ls->stopping &= ~node_mask(node);
-	if (!(ls->stopping & connected_nodes))
-		update_lockspace(ls);
+	if ((type >= MSG_HEARTBEAT && type <= MSG_MCAST_NACK) ||
+	    type == MSG_NODE_FAILED || type == MSG_DEPART ||
+	    type == MSG_DIGEST_END) {
+		if (debug) {
+			printf("< %u %s %u\n", node->nodeid, msg_name(type), id);
+			fflush(stdout);
+		}
+		if (type == MSG_HEARTBEAT)
+			send_heartbeat(node, MSG_HEARTBEAT_ACK, id);
+		else if (type == MSG_HEARTBEAT_ACK)
+			proto_heartbeat_ack(node, id);
+		else if (type == MSG_MCAST_SEQ)
+			proto_mcast_seq(node, id);
+		else if (type == MSG_MCAST_NACK)
+			proto_mcast_nack(node, id);
+		else if (type == MSG_NODE_FAILED)
+			proto_node_failed(node, id);
+		else if (type == MSG_DEPART)
+			proto_depart(node);
+		else
+			proto_digest_end(node);
+		return true;
+	}
+	if (name) {
+		ls = find_lockspace(name);
+		if (!ls && ((type == MSG_STOP_LOCKSPACE && !scoped_peer(node)) ||
+			    type == MSG_JOIN_REQUEST ||
+			    type == MSG_LEAVE_REQUEST))
+			ls = new_lockspace(name);
+	} else {
+		ls = find_lockspace_by_id(id);
+		if (!ls && !(type == MSG_STOP_LOCKSPACE && scoped_peer(node)))
+			warn("%s: Node %u referenced unknown lockspace %08x",
+			     msg_name(type) ? msg_name(type) : "?",
+			     node->nodeid, id);
+	}
+	if (verbose) {
+		printf("< %u %s", node->nodeid,
+		       msg_name(type) ? msg_name(type) : "?");
+		if (ls)
+			printf(" %s", ls->name);
+		else if (name)
+			printf(" %s", name);
+		if (relay)
+			printf(" (%u)", relay->origin->nodeid);
+		printf("\n");
+		fflush(stdout);
+	}
+	if (!ls) {
+		/* We don't keep track of lockspaces we don't use. */
+		if (type == MSG_STOP_LOCKSPACE && !relay && scoped_peer(node))
+			send_unused(node, id);
+		return true;
+	}
+	if (relay) {
+		proto_relay_msg(type, ls, relay);
+		return true;
+	}
+	switch(type) {
+	case MSG_LOCKSPACE_STOPPED:
+		/*
+		 * A node with a round of its own; wait for it to complete.
+		 * Nodes that have asked us to coordinate their change don't
+		 * run a round.
+		 */
+		if (scoped_peer(node) &&
+		    !node_in(mask_or(ls->joining, ls->leaving), node))
+			mask_set(&ls->stopping, node->nodeid);
+		proto_lockspace_stopped(node, ls);
+		break;
+
+	case MSG_MEMBER_STOPPED:
+		mask_set(&ls->members, node->nodeid);
+		proto_lockspace_stopped(node, ls);
+		break;
+
+	case MSG_LOCKSPACE_UNUSED:
+		mask_clear(&ls->members, node->nodeid);
+		proto_lockspace_stopped(node, ls);
+		break;
+
+	case MSG_STOP_LOCKSPACE:
+		proto_stop_lockspace(node, ls);
+		break;
+
+	case MSG_JOIN_LOCKSPACE:
+		proto_join_lockspace(node, ls);
+		break;
+
+	case MSG_RESTART_LOCKSPACE:
+		proto_restart_lockspace(node, ls);
+		break;
+
+	case MSG_LEAVE_LOCKSPACE:
+		proto_leave_lockspace(node, ls);
+		break;
+
+	case MSG_JOIN_REQUEST:
+	case MSG_LEAVE_REQUEST:
+		proto_change_request(node, ls, type == MSG_JOIN_REQUEST);
+		break;
+
+	default:
+		failf("Unknown message %u received", type);
+	}
+	return true;
 }
 
 /*
- * A MSG_LEAVE_LOCKSPACE  message has been received.
+ * Parse a message in the original format.  Returns the length of the message,
+ * 0 if the message is incomplete, or -1 if the connection has been closed.
  */
-static void
-proto_leave_lockspace(struct node *node, const char *name)
+static int
+proto_parse_legacy(struct connection *conn, const char *buf, unsigned int len)
 {
-	struct lockspace *ls;
+	char msg_buf[sizeof(struct proto_msg) + 1];
+	struct proto_msg *msg = (void *)msg_buf;
+	enum msg_type type;
+
+	if (len < sizeof(struct proto_msg))
+		return 0;
+	memcpy(msg_buf, buf, sizeof(struct proto_msg));
+	msg_buf[sizeof(struct proto_msg)] = 0;
+	type = ntohs(msg->msg);
+	if (type == MSG_LOCKSPACE_STOPPED && !msg->lockspace_name[0]) {
+		struct proto_hello hello;
+
+		memcpy(&hello, msg->lockspace_name, sizeof(hello));
+		if (!memcmp(hello.magic, HELLO_MAGIC, sizeof(hello.magic)))
+			proto_hello(conn, &hello);
+		return sizeof(struct proto_msg);
+	}
+	if (!proto_msg(conn, type, msg->lockspace_name, 0, NULL))
+		return -1;
+	return sizeof(struct proto_msg);
+}
 
-	ls = find_lockspace(name);
-	if (!ls)
-		return;
-	if (!(ls->members & node_mask(node))) {
-		warn("MSG_LEAVE_LOCKSPACE: Node %u is not a member",
-		     node->nodeid);
-		return;
+/*
+ * Parse a version 2 message.  Returns the length of the message, 0 if the
+ * message is incomplete, or -1 if the connection has been closed.
+ */
+static int
+proto_parse_v2(struct connection *conn, const char *buf, unsigned int len)
+{
+	char name[DLM_LOCKSPACE_LEN + 1];
+	struct proto_hdr hdr;
+	struct proto_relay rel;
+	struct relay relay;
+	unsigned int msg_len, name_len, pos;
+
+	if (len < sizeof(hdr))
+		return 0;
+	memcpy(&hdr, buf, sizeof(hdr));
+	msg_len = ntohs(hdr.len);
+	if (hdr.msg == MSG_MCAST_DATA) {
+		if (msg_len < sizeof(hdr) || msg_len > sizeof(hdr) +
+		    sizeof(((struct mcast_packet *)NULL)->data))
+			failf("Invalid message length %u received from node %u",
+			      msg_len, conn->node->nodeid);
+		if (len < msg_len)
+			return 0;
+		if (debug) {
+			printf("< %u %s %u\n", conn->node->nodeid,
+			       msg_name(hdr.msg), ntohl(hdr.global_id));
+			fflush(stdout);
+		}
+		mcast_receive(conn, ntohl(hdr.global_id), buf + sizeof(hdr),
+			      msg_len - sizeof(hdr));
+		return msg_len;
 	}
-	ls->leaving |= node_mask(node);
-	ls->stopping &= ~node_mask(node);
-	if (!(ls->stopping & connected_nodes))
-		update_lockspace(ls);
+	if (hdr.msg == MSG_DIGEST) {
+		if (msg_len < sizeof(hdr) || msg_len > MAX_DIGEST_LEN)
+			failf("Invalid message length %u received from node %u",
+			      msg_len, conn->node->nodeid);
+		if (len < msg_len)
+			return 0;
+		proto_digest(conn->node, buf + sizeof(hdr),
+			     msg_len - sizeof(hdr));
+		return msg_len;
+	}
+	if (hdr.msg == MSG_MEMBERSHIP) {
+		struct proto_membership pm;
+		struct membership m = { };
+		node_mask_t *masks[] = { &m.members, &m.joining, &m.leaving };
+		unsigned int n;
+
+		pos = sizeof(hdr) + sizeof(pm);
+		if (msg_len < pos)
+			failf("Invalid message length %u received from node %u",
+			      msg_len, conn->node->nodeid);
+		if (len < msg_len)
+			return 0;
+		memcpy(&pm, buf + sizeof(hdr), sizeof(pm));
+		if (msg_len < pos + ARRAY_SIZE(masks) * pm.mask_words * 8 ||
+		    msg_len - pos - ARRAY_SIZE(masks) * pm.mask_words * 8 >
+		    DLM_LOCKSPACE_LEN)
+			failf("Invalid message length %u received from node %u",
+			      msg_len, conn->node->nodeid);
+		for (n = 0; n < ARRAY_SIZE(masks) * pm.mask_words; n++, pos += 8) {
+			uint64_t word;
+
+			memcpy(&word, buf + pos, sizeof(word));
+			if (n % pm.mask_words < NODE_MASK_WORDS)
+				masks[n / pm.mask_words]->w[n % pm.mask_words] =
+					be64toh(word);
+		}
+		name_len = msg_len - pos;
+		memcpy(name, buf + pos, name_len);
+		name[name_len] = 0;
+		proto_membership(conn->node,
+				 (hdr.flags & MSG_F_NAME) ? name : NULL,
+				 ntohl(hdr.global_id), &m);
+		return msg_len;
+	}
+	if (hdr.flags & MSG_F_BATCH) {
+		unsigned int n;
+
+		if (msg_len < sizeof(hdr) ||
+		    msg_len > sizeof(hdr) + (MAX_BATCH - 1) * sizeof(uint32_t) ||
+		    (msg_len - sizeof(hdr)) % sizeof(uint32_t))
+			failf("Invalid message length %u received from node %u",
+			      msg_len, conn->node->nodeid);
+		if (len < msg_len)
+			return 0;
+		if (!proto_msg(conn, hdr.msg, NULL, ntohl(hdr.global_id), NULL))
+			return -1;
+		for (n = sizeof(hdr); n < msg_len; n += sizeof(uint32_t)) {
+			uint32_t id;
+
+			memcpy(&id, buf + n, sizeof(id));
+			if (!proto_msg(conn, hdr.msg, NULL, ntohl(id), NULL))
+				return -1;
+		}
+		return msg_len;
+	}
+	pos = sizeof(hdr);
+	if (hdr.flags & MSG_F_RELAY)
+		pos += sizeof(rel);
+	if (msg_len < pos)
+		failf("Invalid message length %u received from node %u",
+		      msg_len, conn->node->nodeid);
+	if (len < msg_len)
+		return 0;
+	if (hdr.flags & MSG_F_RELAY) {
+		node_mask_t *masks[] = { &relay.nodes, &relay.stopped };
+		unsigned int n, origin, num_masks;
+
+		memcpy(&rel, buf + sizeof(hdr), sizeof(rel));
+		origin = ntohs(rel.origin);
+		/* The tree nodes, followed by the stopped nodes in replies. */
+		num_masks = hdr.msg == MSG_LOCKSPACE_STOPPED ? 2 : 1;
+		if (origin < 1 || origin > MAX_NODES || !nodes_by_id[origin] ||
+		    !rel.fanout ||
+		    msg_len < pos + num_masks * rel.mask_words * 8)
+			failf("Invalid relayed message received from node %u",
+			      conn->node->nodeid);
+		relay.origin = nodes_by_id[origin];
+		relay.fanout = rel.fanout;
+		relay.nodes = NO_NODES;
+		relay.stopped = NO_NODES;
+		for (n = 0; n < num_masks * rel.mask_words; n++, pos += 8) {
+			uint64_t word;
+
+			memcpy(&word, buf + pos, sizeof(word));
+			if (n % rel.mask_words < NODE_MASK_WORDS)
+				masks[n / rel.mask_words]->w[n % rel.mask_words] =
+					be64toh(word);
+		}
+		if (!node_in(relay.nodes, relay.origin) ||
+		    !node_in(relay.nodes, local_node))
+			failf("Invalid relayed message received from node %u",
+			      conn->node->nodeid);
+		relay.stopped = mask_and(relay.stopped, all_nodes);
+	}
+	if (msg_len - pos > DLM_LOCKSPACE_LEN)
+		failf("Invalid message length %u received from node %u",
+		      msg_len, conn->node->nodeid);
+	name_len = msg_len - pos;
+	memcpy(name, buf + pos, name_len);
+	name[name_len] = 0;
+	if (!proto_msg(conn, hdr.msg, (hdr.flags & MSG_F_NAME) ? name : NULL,
+		       ntohl(hdr.global_id),
+		       (hdr.flags & MSG_F_RELAY) ? &relay : NULL))
+		return -1;
+	return msg_len;
 }
 
 /*
  * The incoming or outgoing socket of a node can be read from.  We try to
  * connect to peer nodes asynchronously, so we can get ECONNREFUSED errors
  * here.
+ *
+ * Read as much as is available at once and process all complete messages;
+ * TCP doesn't preserve message boundaries, so a message can be split across
+ * reads.
  */
 static void
-proto_read(int fd, short revents, void *arg)
+proto_read(struct connection *conn)
 {
-	char buf[sizeof(struct proto_msg) + 1];
-	struct proto_msg *msg = (void *)buf;
-	struct node *node = arg;
+	unsigned int pos;
 	ssize_t ret;
 
-	buf[sizeof(struct proto_msg)] = 0;
+	if (!conn->in_buf) {
+		conn->in_buf = malloc(RECV_BUFFER_SIZE);
+		if (!conn->in_buf)
+			fail(NULL);
+	}
 	for(;;) {
-		ret = read(fd, buf, sizeof(struct proto_msg));
+		size_t space = RECV_BUFFER_SIZE - conn->in_len;
+
+		ret = read(conn->fd, conn->in_buf + conn->in_len, space);
 		if (ret == -1) {
 			if (errno == EAGAIN || errno == EWOULDBLOCK)
 				return;
-			if (errno == ECONNREFUSED)
-				ret = 0;
+			if (errno == EINTR)
+				continue;
+			if (errno != ECONNREFUSED && errno != ECONNRESET &&
+			    errno != ETIMEDOUT)
+				fail(NULL);
+			ret = 0;
 		}
 		if (ret == 0) {
-			proto_close(fd, node);
+			proto_close(conn);
 			return;
 		}
-		if (ret != sizeof(struct proto_msg))
-			fail(NULL);
-		if (verbose) {
-			printf("< %u %s", node->nodeid,
-			       msg_name(ntohs(msg->msg)));
-			if (msg->lockspace_name)
-				printf(" %s", msg->lockspace_name);
-			printf("\n");
-			fflush(stdout);
+		conn->node->last_heard = now_ms();
+		conn->in_len += ret;
+
+		for (pos = 0; pos < conn->in_len; ) {
+			const char *buf = conn->in_buf + pos;
+			unsigned int len = conn->in_len - pos;
+			int msg_len;
+
+			if (!conn->recv_v2)
+				msg_len = proto_parse_legacy(conn, buf, len);
+			else if (conn->node->mcast_holding)
+				msg_len = mcast_hold_msg(conn, buf, len);
+			else
+				msg_len = proto_parse_v2(conn, buf, len);
+			if (msg_len == -1)
+				return;
+			if (msg_len == 0)
+				break;
+			pos += msg_len;
 		}
-		switch(ntohs(msg->msg)) {
-		case MSG_CLOSE:
-			proto_close(fd, node);
-			return;
-
-		case MSG_LOCKSPACE_STOPPED:
-			proto_lockspace_stopped(node, msg->lockspace_name);
-			break;
+		/* Keep partial messages for the next read. */
+		memmove(conn->in_buf, conn->in_buf + pos, conn->in_len - pos);
+		conn->in_len -= pos;
 
-		case MSG_STOP_LOCKSPACE:
-			proto_stop_lockspace(node, msg->lockspace_name);
-			break;
-
-		case MSG_JOIN_LOCKSPACE:
-			proto_join_lockspace(node, msg->lockspace_name);
-			break;
+		/* A short read means that the socket has been drained. */
+		if (ret < space)
+			return;
+	}
+}
 
-		case MSG_LEAVE_LOCKSPACE:
-			proto_leave_lockspace(node, msg->lockspace_name);
-			break;
+/*
+ * Poll callback of established connections.
+ */
+static void
+proto_event(int fd, short revents, void *arg)
+{
+	struct connection *conn = arg;
 
-		default:
-			failf("Unknown message %u received", ntohs(msg->msg));
+	if (revents & POLLOUT) {
+		if (flush_connection(conn) == -1) {
+			fprintf(stderr, "%u: %m\n", conn->node->nodeid);
+			proto_close(conn);
+			return;
 		}
 	}
+	if (revents & ~POLLOUT)
+		proto_read(conn);
 }
 
 /*
@@ -1148,14 +4249,30 @@ proto_read(int fd, short revents, void *arg)
  * connections).
  */
 static struct node *
-sockaddr_to_node(struct sockaddr *sa, socklen_t sa_len)
+tcp_peer_node(struct sockaddr *sa, socklen_t sa_len)
 {
-	struct node *node;
+	struct node_table *table = &node_table;
+	char hbuf[NI_MAXHOST];
+	unsigned int n;
+	int g;
+
+	for (n = addr_hash(sa) & table->mask;
+	     table->slots[n];
+	     n = (n + 1) & table->mask) {
+		struct node *node = table->slots[n];
 
-	for (node = nodes; node; node = node->next) {
 		if (addr_equal(sa, node->addr->sa))
 			return node;
 	}
+
+	g = getnameinfo(sa, sa_len, hbuf, sizeof(hbuf), NULL, 0,
+			NI_NUMERICHOST);
+	if (g) {
+		fprintf(stderr, "%s\n", gai_strerror(g));
+		exit(1);
+	}
+	fprintf(stderr, "Could not determine node-id for node at %s\n",
+		hbuf);
 	return NULL;
 }
 
@@ -1163,15 +4280,53 @@ sockaddr_to_node(struct sockaddr *sa, socklen_t sa_len)
  * Add an incoming (accepted) or outgoing (connecting) socket.
  */
 static void
-add_connection(int fd, struct node *node)
+add_connection(struct connection *conn)
 {
-	if (node->outgoing_fd == -1) {
-		node->outgoing_fd = fd;
+	struct node *node = conn->node;
+
+	del_timer(&node->reconnect_timer);
+	node->connect_attempts = 0;
+	send_hello(conn, HELLO);
+	if (!node->outgoing) {
+		node->outgoing = conn;
 	} else if (local_node->nodeid < node->nodeid) {
 		send_msg(node, MSG_CLOSE, NULL);
-		node->outgoing_fd = fd;
+		node->outgoing = conn;
+	}
+	mask_set(&connected_nodes, node->nodeid);
+	mask_clear(&departing_nodes, node->nodeid);
+	if (!node_in(all_nodes, node)) {
+		printf("Node %u has rejoined the cluster\n", node->nodeid);
+		fflush(stdout);
+		mask_set(&all_nodes, node->nodeid);
 	}
-	connected_nodes |= node_mask(node);
+	node->last_heard = now_ms();
+	if (!timer_pending(&node->heartbeat_timer))
+		add_timer(&node->heartbeat_timer,
+			  failure_timeout / HEARTBEATS_PER_TIMEOUT);
+}
+
+/*
+ * Make the kernel give up on an unresponsive peer after about
+ * failure_timeout milliseconds, whether or not there is unacknowledged data.
+ */
+static void
+set_peer_sockopts(int fd)
+{
+	int one = 1;
+	int user_timeout = failure_timeout;
+	int interval = failure_timeout / HEARTBEATS_PER_TIMEOUT / 1000;
+	int count = HEARTBEATS_PER_TIMEOUT - 1;
+
+	if (interval < 1)
+		interval = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one)) == -1 ||
+	    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &interval, sizeof(interval)) == -1 ||
+	    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) == -1 ||
+	    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) == -1 ||
+	    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout,
+		       sizeof(user_timeout)) == -1)
+		fail(NULL);
 }
 
 /*
@@ -1181,46 +4336,61 @@ add_connection(int fd, struct node *node)
 static void
 incoming_connection(int fd, short revents, void *arg)
 {
-	struct sockaddr sa;
+	struct sockaddr_storage ss;
+	struct sockaddr *sa = (struct sockaddr *)&ss;
 	socklen_t sa_len;
 	int client_fd;
 	struct node *node;
+	struct connection *conn;
 
 	for(;;) {
-		sa_len = sizeof(sa);
-		client_fd = accept4(fd, &sa, &sa_len, SOCK_NONBLOCK);
+		sa_len = sizeof(ss);
+		client_fd = accept4(fd, sa, &sa_len, SOCK_NONBLOCK);
 		if (client_fd == -1) {
 			if (errno == EAGAIN || errno == EWOULDBLOCK)
 				return;
 			fail(NULL);
 		}
 
-		node = sockaddr_to_node(&sa, sa_len);
+		node = transport->peer_node(sa, sa_len);
 		if (!node) {
-			char hbuf[NI_MAXHOST];
-			int g;
-
-			g = getnameinfo(&sa, sa_len, hbuf, sizeof(hbuf), NULL, 0,
-					NI_NUMERICHOST);
-			if (g) {
-				fprintf(stderr, "%s\n", gai_strerror(g));
-				exit(1);
-			}
-			fprintf(stderr, "Could not determine node-id for node at %s\n",
-				hbuf);
 			close(client_fd);
 		} else {
 			if (node->connecting_fd != -1) {
-				close(node->connecting_fd);
 				remove_poll_callback(&cbs, node->connecting_fd);
+				close(node->connecting_fd);
 				node->connecting_fd = -1;
 			}
-			add_poll_callback(&cbs, client_fd, POLLIN, proto_read, node);
-			add_connection(client_fd, node);
+			if (!unix_dir)
+				set_peer_sockopts(client_fd);
+			conn = new_connection(client_fd, node);
+			add_poll_callback(&cbs, client_fd, POLLIN, proto_event, conn);
+			add_connection(conn);
 		}
 	}
 }
 
+/*
+ * Errors that indicate that a peer is not (yet) reachable.
+ */
+static bool
+peer_unreachable(int error)
+{
+	switch(error) {
+	case ECONNREFUSED:
+	case ECONNRESET:
+	case ETIMEDOUT:
+	case EHOSTUNREACH:
+	case EHOSTDOWN:
+	case ENETUNREACH:
+	case ENETDOWN:
+	case ENOENT:  /* AF_UNIX */
+		return true;
+	default:
+		return false;
+	}
+}
+
 /*
  * An outgoing connection has become ready to write to.  Start polling for
  * incoming packets.
@@ -1241,13 +4411,16 @@ outgoing_connection(int fd, short revents, void *arg)
 		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &socket_error, &len) == -1)
 			fail(NULL);
 		close(fd);
-		if (socket_error != ECONNREFUSED) {
+		if (!peer_unreachable(socket_error)) {
 			errno = socket_error;
 			fail(NULL);
 		}
+		schedule_reconnect(node);
 	} else {
-		update_poll_callback(&cbs, fd, POLLIN, proto_read, node);
-		add_connection(fd, node);
+		struct connection *conn = new_connection(fd, node);
+
+		update_poll_callback(&cbs, fd, POLLIN, proto_event, conn);
+		add_connection(conn);
 	}
 }
 
@@ -1266,46 +4439,168 @@ set_port(struct sockaddr_storage *ss, int port)
 }
 
 /*
- * Connect to the first address of each of our peers in non-blocking mode.
+ * Connect to the first address of a peer over TCP.
+ */
+static int
+tcp_connect(struct node *node, int *fdp)
+{
+	struct sockaddr_storage src, dst;
+	struct addr *src_addr = local_node->addr;
+	struct addr *dst_addr = node->addr;
+	int fd;
+
+	memset(&src, 0, sizeof(dst));
+	memcpy(&src, src_addr->sa, src_addr->sa_len);
+	set_port(&src, 0);
+
+	memset(&dst, 0, sizeof(dst));
+	memcpy(&dst, dst_addr->sa, dst_addr->sa_len);
+	set_port(&dst, fakedlm_port);
+
+	fd = socket(dst_addr->family, dst_addr->socktype | SOCK_NONBLOCK,
+		    dst_addr->protocol);
+	if (fd == -1)
+		fail(NULL);
+	*fdp = fd;
+	set_peer_sockopts(fd);
+	if (bind(fd, (struct sockaddr *)&src, src_addr->sa_len) == -1)
+		fail(NULL);
+	return connect(fd, (struct sockaddr *)&dst, dst_addr->sa_len);
+}
+
+/*
+ * The AF_UNIX socket a node listens on is called <unix_dir>/<nodeid>.  Nodes
+ * bind their end of the connections they initiate to
+ * <unix_dir>/<nodeid>-<peer nodeid> so that the peer can tell who is
+ * connecting.
+ */
+static void
+unix_sockaddr(struct sockaddr_un *sun, int nodeid, int peer_nodeid)
+{
+	int len;
+
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (peer_nodeid)
+		len = snprintf(sun->sun_path, sizeof(sun->sun_path), "%s/%d-%d",
+			       unix_dir, nodeid, peer_nodeid);
+	else
+		len = snprintf(sun->sun_path, sizeof(sun->sun_path), "%s/%d",
+			       unix_dir, nodeid);
+	if (len >= sizeof(sun->sun_path)) {
+		fprintf(stderr, "%s: Socket path too long\n", unix_dir);
+		exit(2);
+	}
+}
+
+static int
+unix_connect(struct node *node, int *fdp)
+{
+	struct sockaddr_un src, dst;
+	int fd;
+
+	unix_sockaddr(&src, local_node->nodeid, node->nodeid);
+	unix_sockaddr(&dst, node->nodeid, 0);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd == -1)
+		fail(NULL);
+	*fdp = fd;
+	if (unlink(src.sun_path) == -1 && errno != ENOENT)
+		fail(src.sun_path);
+	if (bind(fd, (struct sockaddr *)&src, sizeof(src)) == -1)
+		fail(src.sun_path);
+	if (connect(fd, (struct sockaddr *)&dst, sizeof(dst)) == -1) {
+		/* The listen backlog is full; try again later. */
+		if (errno == EAGAIN)
+			errno = ECONNREFUSED;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Remove the sockets we have bound to, so that they don't accumulate in
+ * unix_dir from one run to the next.
  */
 static void
-connect_to_peers(void)
+unix_cleanup(void)
 {
+	struct sockaddr_un sun;
 	struct node *node;
 
+	unix_sockaddr(&sun, local_node->nodeid, 0);
+	unlink(sun.sun_path);
 	for (node = nodes; node; node = node->next) {
-		struct sockaddr_storage src, dst;
-		struct addr *src_addr = local_node->addr;
-		struct addr *dst_addr = node->addr;
-		int fd;
-
 		if (node == local_node)
 			continue;
+		unix_sockaddr(&sun, local_node->nodeid, node->nodeid);
+		unlink(sun.sun_path);
+	}
+}
 
-		memset(&src, 0, sizeof(dst));
-		memcpy(&src, src_addr->sa, src_addr->sa_len);
-		set_port(&src, 0);
+static struct node *
+unix_peer_node(struct sockaddr *sa, socklen_t sa_len)
+{
+	struct sockaddr_un *sun = (struct sockaddr_un *)sa;
+	const char *name;
+	int nodeid, peer_nodeid;
+
+	if (sa_len <= offsetof(struct sockaddr_un, sun_path))
+		goto unknown;
+	name = strrchr(sun->sun_path, '/');
+	name = name ? name + 1 : sun->sun_path;
+	if (sscanf(name, "%d-%d", &nodeid, &peer_nodeid) != 2 ||
+	    peer_nodeid != local_node->nodeid ||
+	    nodeid < 1 || nodeid > MAX_NODES || !nodes_by_id[nodeid])
+		goto unknown;
+	return nodes_by_id[nodeid];
+
+unknown:
+	fprintf(stderr, "Could not determine node-id for AF_UNIX peer\n");
+	return NULL;
+}
 
-		memset(&dst, 0, sizeof(dst));
-		memcpy(&dst, dst_addr->sa, dst_addr->sa_len);
-		set_port(&dst, fakedlm_port);
+/*
+ * Connect to a peer in non-blocking mode.  When the connection attempt fails,
+ * another attempt is scheduled.
+ */
+static void
+connect_to_peer(struct node *node)
+{
+	int fd;
 
-		fd = socket(dst_addr->family, dst_addr->socktype | SOCK_NONBLOCK,
-			    dst_addr->protocol);
-		if (fd == -1)
-			fail(NULL);
-		if (bind(fd, (struct sockaddr *)&src, src_addr->sa_len) == -1)
-			fail(NULL);
-		if (connect(fd, (struct sockaddr *)&dst, dst_addr->sa_len) == -1) {
-			if (errno != EINPROGRESS)
+	if (transport->connect(node, &fd) == -1) {
+		if (errno != EINPROGRESS) {
+			if (!peer_unreachable(errno))
 				fail(NULL);
-			node->connecting_fd = fd;
-			add_poll_callback(&cbs, fd, POLLOUT, outgoing_connection, node);
-		} else {
-			/* Connections shouldn't be established immediately ... */
-			update_poll_callback(&cbs, fd, POLLIN, proto_read, node);
-			add_connection(fd, node);
+			close(fd);
+			schedule_reconnect(node);
+			return;
 		}
+		node->connecting_fd = fd;
+		add_poll_callback(&cbs, fd, POLLOUT, outgoing_connection, node);
+		add_timer(&node->reconnect_timer, CONNECT_TIMEOUT_MS);
+	} else {
+		/* TCP connections shouldn't be established immediately ... */
+		struct connection *conn = new_connection(fd, node);
+
+		add_poll_callback(&cbs, fd, POLLIN, proto_event, conn);
+		add_connection(conn);
+	}
+}
+
+/*
+ * Connect to each of our peers.
+ */
+static void
+connect_to_peers(void)
+{
+	struct node *node;
+
+	for (node = nodes; node; node = node->next) {
+		if (node == local_node)
+			continue;
+		connect_to_peer(node);
 	}
 }
 
@@ -1313,7 +4608,7 @@ connect_to_peers(void)
  * Listen on IPv4 and/or IPv6 depending on how the local node is configured.
  */
 static void
-listen_to_peers(void)
+tcp_listen(void)
 {
 	struct addrinfo hints = {
 		.ai_family = AF_UNSPEC,
@@ -1359,6 +4654,114 @@ listen_to_peers(void)
 	freeaddrinfo(res);
 }
 
+static void
+unix_listen(void)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	unix_sockaddr(&sun, local_node->nodeid, 0);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd == -1)
+		fail(NULL);
+	if (unlink(sun.sun_path) == -1 && errno != ENOENT)
+		fail(sun.sun_path);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		fail(sun.sun_path);
+	if (listen(fd, MAX_NODES - 1) == -1)
+		fail(NULL);
+	add_poll_callback(&cbs, fd, POLLIN, incoming_connection,
+			  LISTENING_SOCKET_MARKER);
+}
+
+/*
+ * Join the multicast group given with --multicast on the local node's network
+ * interface.  The group uses the same port number as the TCP connections.
+ */
+static void
+setup_multicast(void)
+{
+	int family = local_node->addr->family;
+	struct addrinfo hints = {
+		.ai_family = family,
+		.ai_socktype = SOCK_DGRAM,
+		.ai_flags = AI_NUMERICHOST,
+	};
+	const int yes = 1, no = 0;
+	struct addrinfo *ai;
+	char *port_str;
+	int g, fd;
+
+	if (asprintf(&port_str, "%u", fakedlm_port) == -1)
+		fail(NULL);
+	g = getaddrinfo(mcast_group, port_str, &hints, &ai);
+	free(port_str);
+	if (g) {
+		fprintf(stderr, "%s: %s\n", mcast_group, gai_strerror(g));
+		exit(2);
+	}
+	memcpy(&mcast_addr, ai->ai_addr, ai->ai_addrlen);
+	mcast_addr_len = ai->ai_addrlen;
+	freeaddrinfo(ai);
+
+	fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (fd == -1)
+		fail(NULL);
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1)
+		fail(NULL);
+	if (bind(fd, (struct sockaddr *)&mcast_addr, mcast_addr_len) == -1)
+		fail(mcast_group);
+	if (family == AF_INET) {
+		struct ip_mreqn mreq;
+
+		memset(&mreq, 0, sizeof(mreq));
+		mreq.imr_multiaddr = ((struct sockaddr_in *)&mcast_addr)->sin_addr;
+		mreq.imr_address =
+			((struct sockaddr_in *)local_node->addr->sa)->sin_addr;
+		if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+			       sizeof(mreq)) == -1 ||
+		    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &mreq,
+			       sizeof(mreq)) == -1 ||
+		    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &no,
+			       sizeof(no)) == -1)
+			fail(mcast_group);
+	} else {
+		int ifindex = addr_ifindex(local_node->addr);
+		struct ipv6_mreq mreq;
+
+		memset(&mreq, 0, sizeof(mreq));
+		mreq.ipv6mr_multiaddr =
+			((struct sockaddr_in6 *)&mcast_addr)->sin6_addr;
+		mreq.ipv6mr_interface = ifindex;
+		if (setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq,
+			       sizeof(mreq)) == -1 ||
+		    setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex,
+			       sizeof(ifindex)) == -1 ||
+		    setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &no,
+			       sizeof(no)) == -1)
+			fail(mcast_group);
+	}
+	mcast_history = calloc(MCAST_HISTORY, sizeof(*mcast_history));
+	if (!mcast_history)
+		fail(NULL);
+	init_timer(&mcast_announce_timer, mcast_announce_timeout);
+	mcast_fd = fd;
+	add_poll_callback(&cbs, fd, POLLIN, mcast_read, NULL);
+}
+
+static const struct transport tcp_transport = {
+	.listen = tcp_listen,
+	.connect = tcp_connect,
+	.peer_node = tcp_peer_node,
+};
+
+static const struct transport unix_transport = {
+	.listen = unix_listen,
+	.connect = unix_connect,
+	.peer_node = unix_peer_node,
+	.cleanup = unix_cleanup,
+};
+
 /*
  * Tell DLM about a new node's ID, address, and whether the node is local.
  */
@@ -1367,17 +4770,15 @@ configure_node(struct node *node)
 {
 	struct sockaddr_storage ss;
 
-	mkdirf(0777, "%scomms/%d", CONFIG_DLM_CLUSTER, node->nodeid);
-	printf_pathf("%d", "%scomms/%d/nodeid", node->nodeid, CONFIG_DLM_CLUSTER,
-		     node->nodeid);
-	if (node == local_node) {
-		printf_pathf("1", "%scomms/%d/local", CONFIG_DLM_CLUSTER,
-			     node->nodeid);
-	}
+	mkdiratf(comms_fd, 0777, "%d", node->nodeid);
+	write_int_atf(comms_fd, node->nodeid, "%d/nodeid", node->nodeid);
+	if (node == local_node)
+		write_int_atf(comms_fd, 1, "%d/local", node->nodeid);
+	if (!node->addr)
+		return;
 	memset(&ss, 0, sizeof(ss));
 	memcpy(&ss, node->addr->sa, node->addr->sa_len);
-	write_pathf(&ss, sizeof(ss), "%scomms/%d/addr",
-		    CONFIG_DLM_CLUSTER, node->nodeid);
+	write_atf(comms_fd, &ss, sizeof(ss), "%d/addr", node->nodeid);
 }
 
 /*
@@ -1394,6 +4795,15 @@ configure_dlm(void)
 		if (mkdir(CONFIG_DLM_CLUSTER, 0777) == -1 && errno != EEXIST)
 			fail(CONFIG_DLM_CLUSTER);
 	}
+	comms_fd = open(CONFIG_DLM_CLUSTER "comms", O_PATH | O_DIRECTORY);
+	if (comms_fd == -1)
+		fail(CONFIG_DLM_CLUSTER "comms");
+	spaces_fd = open(CONFIG_DLM_CLUSTER "spaces", O_PATH | O_DIRECTORY);
+	if (spaces_fd == -1)
+		fail(CONFIG_DLM_CLUSTER "spaces");
+	dlm_sysfs_fd = open(DLM_SYSFS_DIR, O_PATH | O_DIRECTORY);
+	if (dlm_sysfs_fd == -1)
+		fail(DLM_SYSFS_DIR);
 	if (cluster_name)
 		printf_pathf("%s", "%s", cluster_name,
 			     CONFIG_DLM_CLUSTER "cluster_name");
@@ -1419,13 +4829,20 @@ remove_dlm(void)
 {
 	struct node *node;
 
-	for (node = nodes; node; node = node->next)
-		rmdirf("%scomms/%d", CONFIG_DLM_CLUSTER, node->nodeid);
-	rmdirf("%s", CONFIG_DLM_CLUSTER);
+	if (comms_fd != -1) {
+		for (node = nodes; node; node = node->next)
+			rmdiratf(comms_fd, "%d", node->nodeid);
+		close(comms_fd);
+		close(spaces_fd);
+		close(dlm_sysfs_fd);
+		rmdirf("%s", CONFIG_DLM_CLUSTER);
+	}
 
 	if (control_fd != -1)
 		close(control_fd);
-	close(kernel_monitor_fd);
+	uring_exit(&ring);
+	if (kernel_monitor_fd != -1)
+		close(kernel_monitor_fd);
 	rmmod("dlm");
 }
 
@@ -1503,31 +4920,245 @@ listen_to_uvents(void)
 	add_poll_callback(&cbs, uevent_fd, POLLIN, recv_uevent, NULL);
 }
 
+/*
+ * Simulate a lockspace online or offline uevent (--simulate).
+ */
+static void
+simulate_uevent(const char *line)
+{
+	const char *name = strchr(line, ' ');
+
+	if (!name || strlen(name + 1) < 1 ||
+	    strlen(name + 1) > DLM_LOCKSPACE_LEN) {
+		if (*line)
+			warn("Invalid command '%s'", line);
+		return;
+	}
+	name++;
+	if (strncmp(line, "join ", 5) == 0)
+		lockspace_online_uevent(name);
+	else if (strncmp(line, "leave ", 6) == 0)
+		lockspace_offline_uevent(name);
+	else
+		warn("Invalid command '%s'", line);
+}
+
+static void
+recv_commands(int fd, short revents, void *arg)
+{
+	static char buf[MAX_LINE_UEVENT + 1];
+	static unsigned int len;
+	char *line, *nl;
+	ssize_t ret;
+
+	ret = read(fd, buf + len, sizeof(buf) - 1 - len);
+	if (ret <= 0) {
+		if (ret == -1 && errno == EINTR)
+			return;
+		if (ret == -1)
+			fail("stdin");
+		remove_poll_callback(&cbs, fd);
+		return;
+	}
+	len += ret;
+	line = buf;
+	while ((nl = memchr(line, '\n', buf + len - line))) {
+		*nl = 0;
+		simulate_uevent(line);
+		line = nl + 1;
+	}
+	len = buf + len - line;
+	memmove(buf, line, len);
+	if (len == sizeof(buf) - 1) {
+		warn("Command too long");
+		len = 0;
+	}
+}
+
+/*
+ * With --simulate, there is no kernel DLM to send uevents when lockspaces
+ * are created or removed.  Instead, read "join <name>" and "leave <name>"
+ * commands from standard input when it is a terminal, pipe, or socket.
+ */
+static void
+listen_to_commands(void)
+{
+	struct stat st;
+
+	if (fstat(STDIN_FILENO, &st) == -1)
+		fail("stdin");
+	if (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode) ||
+	    isatty(STDIN_FILENO))
+		add_poll_callback(&cbs, STDIN_FILENO, POLLIN, recv_commands,
+				  NULL);
+}
+
+/*
+ * Asynchronous writes submitted through io_uring have completed.
+ */
+static void
+uring_completion(int fd, short revents, void *arg)
+{
+	struct io_uring_cqe *cqe;
+
+	while ((cqe = uring_peek_cqe(&ring))) {
+		struct aio_request *req = (void *)(uintptr_t)cqe->user_data;
+
+		if (cqe->res < 0)
+			req->error = -cqe->res;
+		else if (cqe->res != req->nbytes)
+			req->error = EIO;
+		else
+			req->error = 0;
+		uring_cqe_seen(&ring);
+		list_del(&req->list);
+		list_add_tail(&req->list, &aio_completed);
+	}
+}
+
+/*
+ * Asynchronous writes submitted through POSIX aio have completed.  Pick up
+ * all the completions queued since the last wakeup at once.
+ */
+static void
+aio_completion(int fd, short revents, void *arg)
+{
+	struct mpsc_node *node;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) == -1) {
+		if (errno == EAGAIN)
+			return;
+		fail(NULL);
+	}
+	node = mpsc_pop_all(&aio_notified);
+	while (node) {
+		struct aio_request *req =
+			container_of(node, struct aio_request, notified);
+
+		node = node->next;
+		list_del(&req->list);
+		list_add_tail(&req->list, &aio_completed);
+	}
+}
+
+/*
+ * Use io_uring for asynchronous writes when available, and fall back to POSIX
+ * aio otherwise.
+ */
+static void
+setup_aio(void)
+{
+	if (uring_init(&ring, URING_ENTRIES) == 0) {
+		add_poll_callback(&cbs, ring.fd, POLLIN, uring_completion, NULL);
+		return;
+	}
+	if (verbose) {
+		printf("io_uring not available (%m), using POSIX aio\n");
+		fflush(stdout);
+	}
+	aio_notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (aio_notify_fd == -1)
+		fail(NULL);
+	add_poll_callback(&cbs, aio_notify_fd, POLLIN, aio_completion, NULL);
+}
+
+/*
+ * Dump some internal state, on SIGUSR2.
+ */
+static void
+print_status(FILE *file)
+{
+	struct node *node;
+
+	for (node = nodes; node; node = node->next) {
+		if (node == local_node || !node->outgoing)
+			continue;
+		fprintf(file, "node %u: rtt %u us, srtt %u us, last heard %llu "
+			"ms ago\n", node->nodeid, node->rtt, node->srtt,
+			(unsigned long long)(now_ms() - node->last_heard));
+	}
+	print_pool(file, &lockspace_pool);
+	print_pool(file, &stop_request_pool);
+	print_pool(file, &release_request_pool);
+	print_pool(file, &tree_round_pool);
+	fflush(file);
+}
+
+/*
+ * Tell our peers that we are shutting down, so that they don't treat our
+ * disconnecting as a failure once we have left all lockspaces.  Returns
+ * whether the connections should be kept open until then.
+ */
+static bool
+depart_cluster(void)
+{
+	node_mask_t peers = mask_andnot(connected_nodes, node_mask(local_node));
+	int nodeid;
+
+	if (!mask_equal(connected_nodes, all_nodes) ||
+	    !peers_capable(peers, CAP_DEPART))
+		return false;
+	for_each_nodeid(nodeid, peers)
+		send_hdr_msg(nodes_by_id[nodeid]->outgoing, MSG_DEPART, 0);
+	return true;
+}
+
+/*
+ * Wait for events for up to timeout milliseconds (-1 for no limit), and run
+ * the callbacks of the file descriptors that are ready.  Returns false if
+ * the wait was interrupted by a signal.
+ */
+static bool
+dispatch_poll_events(int timeout)
+{
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	int ret, n;
+
+	ret = epoll_wait(cbs.epoll_fd, events, MAX_EPOLL_EVENTS, timeout);
+	if (ret == -1) {
+		if (errno == EINTR)
+			return false;
+		fail(NULL);
+	}
+	for (n = 0; n < ret; n++) {
+		struct poll_callback *pcb = events[n].data.ptr;
+
+		/* Skip callbacks removed by an earlier callback. */
+		if (pcb->callback)
+			pcb->callback(pcb->fd, events[n].events, pcb->arg);
+	}
+	free_removed_poll_callbacks(&cbs);
+	return true;
+}
+
 /*
  * The main event loop.
  */
 static void
 event_loop(void)
 {
-	node_mask_t old_connected_nodes = 0;
+	node_mask_t old_connected_nodes = NO_NODES;
 	int old_shut_down = 0;
 
 	while (!old_shut_down ||
 	       joined_lockspaces ||
 	       !list_empty(&aio_pending) ||
 	       !list_empty(&aio_completed)) {
-		int ret, n;
-
-		if (connected_nodes != old_connected_nodes) {
+		if (dump_status) {
+			dump_status = 0;
+			print_status(stdout);
+		}
+		if (!mask_equal(connected_nodes, old_connected_nodes)) {
 			if (verbose) {
 				print_nodes(stdout, connected_nodes);
 				printf("\n");
 				fflush(stdout);
 			}
-			if (connected_nodes == all_nodes) {
+			if (mask_equal(connected_nodes, all_nodes)) {
 				printf("DLM ready\n");
 				fflush(stdout);
-			} else if (old_connected_nodes == all_nodes) {
+			} else if (mask_equal(old_connected_nodes, all_nodes)) {
 				printf("DLM not ready\n");
 				fflush(stdout);
 			}
@@ -1547,7 +5178,8 @@ event_loop(void)
 				break;
 			}
 			fflush(stdout);
-			close_all_connections();
+			if (shut_down > 1 || !depart_cluster())
+				close_all_connections();
 			if (joined_lockspaces && shut_down <= 2)
 				release_lockspaces(shut_down > 1);
 			else
@@ -1562,34 +5194,24 @@ event_loop(void)
 					list_first_entry(&aio_completed,
 							 struct aio_request,
 							 list);
-				int err;
 
 				list_del(&req->list);
-				err = aio_error(&req->aiocb);
-				if (err > 0)
-					errno = err;
+				if (req->error)
+					errno = req->error;
 				req->complete(req);
 			}
 			continue;
 		}
 
-		ret = poll(cbs.pollfds, cbs.num, -1);
-		if (ret == -1) {
-			if (errno == EINTR)
-				continue;
+		flush_all_connections();
+		if (ring.fd != -1 && uring_submit(&ring) == -1)
 			fail(NULL);
-		}
-
-		for (n = 0; n < cbs.num; n++) {
-			struct pollfd *pfd = &cbs.pollfds[n];
 
-			if (pfd->revents) {
-				struct poll_callback *pcb = &cbs.callbacks[n];
-
-				pcb->callback(pfd->fd, pfd->revents, pcb->arg);
-			}
-		}
+		if (!dispatch_poll_events(next_timer_timeout()))
+			continue;
+		run_timers();
 	}
+	close_all_connections();
 }
 
 /*
@@ -1602,21 +5224,13 @@ handle_shutdown(int signo)
 }
 
 /*
- * SIGUSR1 handler for asynchronous I/O completion notifications.
+ * SIGUSR2 signal handler: dump some internal state on the next event loop
+ * iteration.
  */
 static void
-handle_aio(int sig, siginfo_t *si, void *ucontext)
+handle_dump_status(int signo)
 {
-	if (si->si_code == SI_ASYNCIO) {
-		struct aio_request *req = si->si_value.sival_ptr;
-		int err;
-
-		err = aio_error(&req->aiocb);
-		if (err != EINPROGRESS) {
-			list_del(&req->list);
-			list_add_tail(&req->list, &aio_completed);
-		}
-	}
+	dump_status = 1;
 }
 
 static void
@@ -1632,10 +5246,8 @@ setup_signals(void)
 	if (sigaction(SIGINT, &sa, NULL) == -1 ||
 	    sigaction(SIGTERM, &sa, NULL) == -1)
 		fail(NULL);
-
-	sa.sa_flags = SA_RESTART | SA_SIGINFO;
-	sa.sa_sigaction = handle_aio;
-	if (sigaction(SIGUSR1, &sa, NULL) == -1)
+	sa.sa_handler = handle_dump_status;
+	if (sigaction(SIGUSR2, &sa, NULL) == -1)
 		fail(NULL);
 }
 
@@ -1644,7 +5256,13 @@ usage(int status)
 {
 	fprintf(status ? stderr : stdout,
 		"USAGE: %s [--verbose] [--cluster-name=name] "
-		"[--fakedlm-port=port] [--dlm-port=port] node ...\n",
+		"[--fakedlm-port=port] [--dlm-port=port] "
+		"[--failure-timeout=seconds] "
+		"[--simulate [--unix=dir --node-id=id]] "
+		"[--multicast=group | --tree=fanout] [--evict] "
+		"[--coordinated] node ...\n"
+		"\n"
+		"Send SIGUSR2 to print round-trip times and memory pool usage.\n",
 		progname);
 	exit(status);
 }
@@ -1656,6 +5274,14 @@ static struct option long_options[] = {
 	{ "verbose", no_argument, NULL, 'v' },
 	{ "sctp", no_argument, NULL, 2 },
 	{ "debug", no_argument, NULL, 'd' },
+	{ "failure-timeout", required_argument, NULL, 3 },
+	{ "unix", required_argument, NULL, 4 },
+	{ "node-id", required_argument, NULL, 5 },
+	{ "multicast", required_argument, NULL, 6 },
+	{ "tree", required_argument, NULL, 7 },
+	{ "evict", no_argument, NULL, 8 },
+	{ "coordinated", no_argument, NULL, 9 },
+	{ "simulate", no_argument, NULL, 10 },
 	{ }
 };
 
@@ -1663,8 +5289,11 @@ int main(int argc, char *argv[])
 {
 	char *node_names[argc - 1];
 	int opt, count = 0;
+	double seconds;
+	char *end;
 
 	progname = argv[0];
+	srandom(getpid() ^ now_ms());
 	while ((opt = getopt_long(argc, argv, "-n:P:p:vd", long_options, NULL)) != -1) {
 		switch(opt) {
 		case 1:  /* node */
@@ -1675,6 +5304,48 @@ int main(int argc, char *argv[])
 			dlm_protocol = PROTO_SCTP;
 			break;
 
+		case 3:  /* --failure-timeout */
+			seconds = strtod(optarg, &end);
+			if (end == optarg || *end || !(seconds > 0) ||
+			    seconds > INT_MAX / 1000)
+				usage(2);
+			failure_timeout = seconds * 1000;
+			if (failure_timeout < HEARTBEATS_PER_TIMEOUT)
+				usage(2);
+			break;
+
+		case 4:  /* --unix */
+			unix_dir = optarg;
+			break;
+
+		case 5:  /* --node-id */
+			local_nodeid = atoi(optarg);
+			if (local_nodeid < 1)
+				usage(2);
+			break;
+
+		case 6:  /* --multicast */
+			mcast_group = optarg;
+			break;
+
+		case 7:  /* --tree */
+			tree_fanout = atoi(optarg);
+			if (tree_fanout < 1 || tree_fanout > 255)
+				usage(2);
+			break;
+
+		case 8:  /* --evict */
+			evict_failed = true;
+			break;
+
+		case 9:  /* --coordinated */
+			coordinated = true;
+			break;
+
+		case 10:  /* --simulate */
+			simulate = true;
+			break;
+
 		case 'd':  /* --debug */
 			debug = true;
 			break;
@@ -1701,18 +5372,43 @@ int main(int argc, char *argv[])
 	}
 	if (count == 0)
 		usage(0);
+	if (unix_dir && !simulate) {
+		fprintf(stderr, "%s: --unix requires --simulate\n", progname);
+		exit(2);
+	}
+	if (unix_dir && !local_nodeid) {
+		fprintf(stderr, "%s: --unix requires --node-id\n", progname);
+		exit(2);
+	}
+	if (unix_dir && mcast_group) {
+		fprintf(stderr, "%s: --multicast requires TCP\n", progname);
+		exit(2);
+	}
+	if (tree_fanout && mcast_group) {
+		fprintf(stderr, "%s: --tree and --multicast are mutually "
+			"exclusive\n", progname);
+		exit(2);
+	}
+	transport = unix_dir ? &unix_transport : &tcp_transport;
 
 	parse_nodes(node_names, count);
 	setup_signals();
-	if (all_nodes & (all_nodes - 1)) {
-		/* More than one bit set in all_nodes. */
-		listen_to_peers();
+	init_poll_callbacks(&cbs);
+	setup_aio();
+	if (mcast_group && mask_weight(all_nodes) > 1)
+		setup_multicast();
+	if (mask_weight(all_nodes) > 1) {
+		transport->listen();
 		connect_to_peers();
 	}
-	monitor_kernel();
-	listen_to_uvents();
-	configure_dlm();
+	if (simulate)
+		listen_to_commands();
+	else
+		monitor_kernel();
 	event_loop();
-	remove_dlm();
+	if (transport->cleanup)
+		transport->cleanup();
+	if (!simulate)
+		remove_dlm();
 	return 0;
 }
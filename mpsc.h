@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2026  FakeDLM contributors
+ *
+ * This file is part of FakeDLM, which is distributed under the terms of the
+ * GNU General Public License, version 3 or later; see COPYING.
+ */
+
+#ifndef __MPSC_H
+#define __MPSC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A lock-free multiple-producer, single-consumer queue.  Producers push
+ * individual entries from any thread; the consumer takes all queued entries
+ * at once.
+ */
+
+struct mpsc_node {
+	struct mpsc_node *next;
+};
+
+struct mpsc_queue {
+	struct mpsc_node *head;
+};
+
+#define MPSC_QUEUE_INIT { NULL }
+
+/*
+ * Add an entry to the queue.  Returns true if the queue was empty before, in
+ * which case the consumer may need to be woken up.
+ */
+static inline bool
+mpsc_push(struct mpsc_queue *queue, struct mpsc_node *node)
+{
+	struct mpsc_node *head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+
+	do {
+		node->next = head;
+	} while (!__atomic_compare_exchange_n(&queue->head, &head, node, true,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+	return head == NULL;
+}
+
+/*
+ * Take all entries off the queue.  Returns them in the order in which they
+ * were pushed.
+ */
+static inline struct mpsc_node *
+mpsc_pop_all(struct mpsc_queue *queue)
+{
+	struct mpsc_node *node, *next, *prev = NULL;
+
+	node = __atomic_exchange_n(&queue->head, NULL, __ATOMIC_ACQUIRE);
+	while (node) {
+		next = node->next;
+		node->next = prev;
+		prev = node;
+		node = next;
+	}
+	return prev;
+}
+
+#endif  /* __MPSC_H */
@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2026  FakeDLM contributors
+ *
+ * This file is part of FakeDLM, which is distributed under the terms of the
+ * GNU General Public License, version 3 or later; see COPYING.
+ */
+
+#ifndef __NODEMASK_H
+#define __NODEMASK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Fixed-size sets of node IDs (1 .. MAX_NODES).  MAX_NODES is a compile-time
+ * constant, so all operations work on a fixed number of words, and the
+ * default of 64 nodes fits into a single register.
+ */
+
+#ifndef MAX_NODES
+#define MAX_NODES 64
+#endif
+
+#define NODE_MASK_BITS 64
+#define NODE_MASK_WORDS ((MAX_NODES + NODE_MASK_BITS - 1) / NODE_MASK_BITS)
+
+typedef struct {
+	uint64_t w[NODE_MASK_WORDS];
+} node_mask_t;
+
+#define NO_NODES ((node_mask_t){ { 0 } })
+
+static inline node_mask_t
+nodeid_mask(int nodeid)
+{
+	node_mask_t mask = NO_NODES;
+
+	mask.w[(nodeid - 1) / NODE_MASK_BITS] =
+		1ULL << ((nodeid - 1) % NODE_MASK_BITS);
+	return mask;
+}
+
+static inline bool
+mask_test(node_mask_t mask, int nodeid)
+{
+	return (mask.w[(nodeid - 1) / NODE_MASK_BITS] >>
+		((nodeid - 1) % NODE_MASK_BITS)) & 1;
+}
+
+static inline void
+mask_set(node_mask_t *mask, int nodeid)
+{
+	mask->w[(nodeid - 1) / NODE_MASK_BITS] |=
+		1ULL << ((nodeid - 1) % NODE_MASK_BITS);
+}
+
+static inline void
+mask_clear(node_mask_t *mask, int nodeid)
+{
+	mask->w[(nodeid - 1) / NODE_MASK_BITS] &=
+		~(1ULL << ((nodeid - 1) % NODE_MASK_BITS));
+}
+
+static inline node_mask_t
+mask_or(node_mask_t a, node_mask_t b)
+{
+	int n;
+
+	for (n = 0; n < NODE_MASK_WORDS; n++)
+		a.w[n] |= b.w[n];
+	return a;
+}
+
+static inline node_mask_t
+mask_and(node_mask_t a, node_mask_t b)
+{
+	int n;
+
+	for (n = 0; n < NODE_MASK_WORDS; n++)
+		a.w[n] &= b.w[n];
+	return a;
+}
+
+/* The nodes in a but not in b. */
+static inline node_mask_t
+mask_andnot(node_mask_t a, node_mask_t b)
+{
+	int n;
+
+	for (n = 0; n < NODE_MASK_WORDS; n++)
+		a.w[n] &= ~b.w[n];
+	return a;
+}
+
+static inline bool
+mask_empty(node_mask_t mask)
+{
+	uint64_t bits = 0;
+	int n;
+
+	for (n = 0; n < NODE_MASK_WORDS; n++)
+		bits |= mask.w[n];
+	return !bits;
+}
+
+static inline bool
+mask_equal(node_mask_t a, node_mask_t b)
+{
+	uint64_t bits = 0;
+	int n;
+
+	for (n = 0; n < NODE_MASK_WORDS; n++)
+		bits |= a.w[n] ^ b.w[n];
+	return !bits;
+}
+
+/* Are all the nodes in a also in b? */
+static inline bool
+mask_subset(node_mask_t a, node_mask_t b)
+{
+	return mask_empty(mask_andnot(a, b));
+}
+
+static inline bool
+mask_intersects(node_mask_t a, node_mask_t b)
+{
+	return !mask_empty(mask_and(a, b));
+}
+
+/* The number of nodes in a mask. */
+static inline int
+mask_weight(node_mask_t mask)
+{
+	int n, weight = 0;
+
+	for (n = 0; n < NODE_MASK_WORDS; n++)
+		weight += __builtin_popcountll(mask.w[n]);
+	return weight;
+}
+
+/* The lowest node ID in a mask above @nodeid, or 0 if there is none. */
+static inline int
+mask_next(node_mask_t mask, int nodeid)
+{
+	int n = nodeid / NODE_MASK_BITS;
+	uint64_t bits;
+
+	if (n >= NODE_MASK_WORDS)
+		return 0;
+	bits = mask.w[n] & (~0ULL << (nodeid % NODE_MASK_BITS));
+	for (;;) {
+		if (bits)
+			return n * NODE_MASK_BITS + __builtin_ctzll(bits) + 1;
+		if (++n == NODE_MASK_WORDS)
+			return 0;
+		bits = mask.w[n];
+	}
+}
+
+/* The lowest node ID in a mask, or 0 if the mask is empty. */
+static inline int
+mask_first(node_mask_t mask)
+{
+	return mask_next(mask, 0);
+}
+
+/* The number of nodes in a mask below @nodeid. */
+static inline int
+mask_rank(node_mask_t mask, int nodeid)
+{
+	int n, bit = nodeid - 1, rank = 0;
+
+	for (n = 0; n < bit / NODE_MASK_BITS; n++)
+		rank += __builtin_popcountll(mask.w[n]);
+	if (bit % NODE_MASK_BITS)
+		rank += __builtin_popcountll(mask.w[n] &
+			(~0ULL >> (NODE_MASK_BITS - bit % NODE_MASK_BITS)));
+	return rank;
+}
+
+/* The node ID at position @rank in a mask (counting from 0), or 0. */
+static inline int
+mask_nth(node_mask_t mask, int rank)
+{
+	int n;
+
+	for (n = 0; n < NODE_MASK_WORDS; n++) {
+		uint64_t bits = mask.w[n];
+		int weight = __builtin_popcountll(bits);
+
+		if (rank >= weight) {
+			rank -= weight;
+			continue;
+		}
+		while (rank--)
+			bits &= bits - 1;
+		return n * NODE_MASK_BITS + __builtin_ctzll(bits) + 1;
+	}
+	return 0;
+}
+
+#define for_each_nodeid(nodeid, mask) \
+	for (nodeid = mask_first(mask); \
+	     nodeid; \
+	     nodeid = mask_next(mask, nodeid))
+
+#endif  /* __NODEMASK_H */
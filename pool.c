@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2026  FakeDLM contributors
+ *
+ * This file is part of FakeDLM.
+ *
+ * FakeDLM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * FakeDLM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FakeDLM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "pool.h"
+
+#define POOL_SLAB_SIZE 4096
+#define POOL_ALIGN __alignof__(max_align_t)
+
+/*
+ * Free objects are linked through their first word.
+ */
+struct pool_free_obj {
+	struct pool_free_obj *next;
+};
+
+static void
+grow_pool(struct pool *pool)
+{
+	unsigned int n;
+	char *slab;
+
+	if (!pool->per_slab) {
+		pool->size = (pool->size + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+		pool->per_slab = POOL_SLAB_SIZE / pool->size;
+		if (!pool->per_slab)
+			pool->per_slab = 1;
+	}
+	slab = malloc(pool->per_slab * pool->size);
+	if (!slab)
+		fail(NULL);
+	for (n = pool->per_slab; n > 0; n--) {
+		struct pool_free_obj *obj =
+			(void *)(slab + (n - 1) * pool->size);
+
+		obj->next = pool->free_list;
+		pool->free_list = obj;
+	}
+	pool->slabs++;
+}
+
+/*
+ * Allocate a zeroed object.  Fails hard when out of memory, like the rest of
+ * FakeDLM.
+ */
+void *
+pool_alloc(struct pool *pool)
+{
+	struct pool_free_obj *obj;
+
+	if (!pool->free_list)
+		grow_pool(pool);
+	obj = pool->free_list;
+	pool->free_list = obj->next;
+	pool->live++;
+	if (pool->live > pool->high_water)
+		pool->high_water = pool->live;
+	memset(obj, 0, pool->size);
+	return obj;
+}
+
+void
+pool_free(struct pool *pool, void *ptr)
+{
+	struct pool_free_obj *obj = ptr;
+
+	obj->next = pool->free_list;
+	pool->free_list = obj;
+	pool->live--;
+}
+
+void
+print_pool(FILE *file, const struct pool *pool)
+{
+	fprintf(file, "pool %s: %u live, %u high water, %u slab(s) of %u x %zu "
+		"bytes\n", pool->name, pool->live, pool->high_water,
+		pool->slabs, pool->per_slab, pool->size);
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2026  FakeDLM contributors
+ *
+ * This file is part of FakeDLM, which is distributed under the terms of the
+ * GNU General Public License, version 3 or later; see COPYING.
+ */
+
+#ifndef __POOL_H
+#define __POOL_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * A pool of fixed-size objects.  Objects are carved out of larger slabs and
+ * recycled through a free list, so allocating and freeing them is cheap and
+ * does not go through the general-purpose heap.  Slabs are never returned.
+ */
+struct pool {
+	const char *name;
+	size_t size;  /* object size, rounded up for alignment */
+	unsigned int per_slab;
+	void *free_list;
+	unsigned int slabs;
+	unsigned int live;  /* objects currently allocated */
+	unsigned int high_water;  /* maximum of live so far */
+};
+
+#define POOL_INIT(_name, type) \
+	{ .name = (_name), .size = sizeof(type) }
+
+extern void *pool_alloc(struct pool *pool);
+extern void pool_free(struct pool *pool, void *obj);
+extern void print_pool(FILE *file, const struct pool *pool);
+
+#endif  /* __POOL_H */
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2026  FakeDLM contributors
+ *
+ * This file is part of FakeDLM.
+ *
+ * FakeDLM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * FakeDLM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FakeDLM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <time.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "timer.h"
+
+static struct timer **heap;
+static int heap_size, heap_num;
+
+uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		fail(NULL);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+uint64_t
+now_us(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		fail(NULL);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void
+heap_set(int index, struct timer *timer)
+{
+	heap[index] = timer;
+	timer->index = index;
+}
+
+static void
+heap_up(int index)
+{
+	struct timer *timer = heap[index];
+
+	while (index) {
+		int parent = (index - 1) / 2;
+
+		if (heap[parent]->expires <= timer->expires)
+			break;
+		heap_set(index, heap[parent]);
+		index = parent;
+	}
+	heap_set(index, timer);
+}
+
+static void
+heap_down(int index)
+{
+	struct timer *timer = heap[index];
+
+	for (;;) {
+		int child = 2 * index + 1;
+
+		if (child >= heap_num)
+			break;
+		if (child + 1 < heap_num &&
+		    heap[child + 1]->expires < heap[child]->expires)
+			child++;
+		if (timer->expires <= heap[child]->expires)
+			break;
+		heap_set(index, heap[child]);
+		index = child;
+	}
+	heap_set(index, timer);
+}
+
+void
+init_timer(struct timer *timer, void (*callback)(struct timer *))
+{
+	timer->expires = 0;
+	timer->index = -1;
+	timer->callback = callback;
+}
+
+/*
+ * Arm a timer to expire in @msecs milliseconds, or re-arm it if it is already
+ * pending.
+ */
+void
+add_timer(struct timer *timer, unsigned int msecs)
+{
+	uint64_t old_expires = timer->expires;
+
+	timer->expires = now_ms() + msecs;
+	if (timer_pending(timer)) {
+		if (timer->expires < old_expires)
+			heap_up(timer->index);
+		else
+			heap_down(timer->index);
+		return;
+	}
+	if (heap_num == heap_size) {
+		heap_size = heap_size ? heap_size * 2 : 16;
+		heap = realloc(heap, heap_size * sizeof(*heap));
+		if (!heap)
+			fail(NULL);
+	}
+	heap_set(heap_num++, timer);
+	heap_up(timer->index);
+}
+
+/*
+ * Cancel a timer.  Does nothing if the timer is not pending.
+ */
+void
+del_timer(struct timer *timer)
+{
+	int index = timer->index;
+
+	if (index == -1)
+		return;
+	timer->index = -1;
+	heap_num--;
+	if (index == heap_num)
+		return;
+	heap_set(index, heap[heap_num]);
+	if (index && heap[(index - 1) / 2]->expires > heap[index]->expires)
+		heap_up(index);
+	else
+		heap_down(index);
+}
+
+/*
+ * The number of milliseconds until the next timer expires, or -1 when no
+ * timers are pending (suitable as a poll timeout).
+ */
+int
+next_timer_timeout(void)
+{
+	uint64_t now;
+
+	if (!heap_num)
+		return -1;
+	now = now_ms();
+	if (heap[0]->expires <= now)
+		return 0;
+	if (heap[0]->expires - now > INT_MAX)
+		return INT_MAX;
+	return heap[0]->expires - now;
+}
+
+/*
+ * Run the callbacks of all expired timers.  The callbacks may re-arm their
+ * timers.
+ */
+void
+run_timers(void)
+{
+	uint64_t now;
+
+	if (!heap_num)
+		return;
+	now = now_ms();
+	while (heap_num && heap[0]->expires <= now) {
+		struct timer *timer = heap[0];
+
+		del_timer(timer);
+		timer->callback(timer);
+	}
+}
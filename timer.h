@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2026  FakeDLM contributors
+ *
+ * This file is part of FakeDLM, which is distributed under the terms of the
+ * GNU General Public License, version 3 or later; see COPYING.
+ */
+
+#ifndef __TIMER_H
+#define __TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * A one-shot timer.  Pending timers are kept in a binary min-heap ordered by
+ * expiry time, so arming, cancelling, and finding the next timer to expire
+ * are cheap even with many timers.
+ */
+struct timer {
+	uint64_t expires;  /* CLOCK_MONOTONIC, in milliseconds */
+	int index;  /* heap position, or -1 when not pending */
+	void (*callback)(struct timer *);
+};
+
+extern uint64_t now_ms(void);
+extern uint64_t now_us(void);
+extern void init_timer(struct timer *timer, void (*callback)(struct timer *));
+extern void add_timer(struct timer *timer, unsigned int msecs);
+extern void del_timer(struct timer *timer);
+extern int next_timer_timeout(void);
+extern void run_timers(void);
+
+static inline bool
+timer_pending(const struct timer *timer)
+{
+	return timer->index != -1;
+}
+
+#endif  /* __TIMER_H */
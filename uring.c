@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2026  FakeDLM contributors
+ *
+ * This file is part of FakeDLM.
+ *
+ * FakeDLM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * FakeDLM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with FakeDLM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Just enough of io_uring for submitting writes and reaping their completions
+ * from the event loop, without depending on liburing.  The ring file
+ * descriptor becomes readable when completions are available.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "uring.h"
+
+static int
+io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+	       unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+/*
+ * Set up a ring with room for (at least) @entries submissions.  Returns -1
+ * with errno set when io_uring is not available.
+ */
+int
+uring_init(struct uring *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+	void *sqes;
+	unsigned int n;
+	unsigned int *sq_array;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	ring->fd = io_uring_setup(entries, &p);
+	if (ring->fd == -1)
+		return -1;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes +
+			     p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			munmap(ring->sq_ring, ring->sq_ring_size);
+			goto fail;
+		}
+	}
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    ring->fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		if (ring->cq_ring != ring->sq_ring)
+			munmap(ring->cq_ring, ring->cq_ring_size);
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		goto fail;
+	}
+	ring->sqes = sqes;
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_flags = ring->sq_ring + p.sq_off.flags;
+	ring->sq_mask = *(unsigned int *)(ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->sqe_tail = *ring->sq_tail;
+
+	/* Submission queue entries are always used in order. */
+	sq_array = ring->sq_ring + p.sq_off.array;
+	for (n = 0; n < p.sq_entries; n++)
+		sq_array[n] = n;
+
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = *(unsigned int *)(ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+	return 0;
+
+fail:
+	n = errno;
+	close(ring->fd);
+	ring->fd = -1;
+	errno = n;
+	return -1;
+}
+
+void
+uring_exit(struct uring *ring)
+{
+	if (ring->fd == -1)
+		return;
+	munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+/*
+ * Get the next free submission queue entry, or NULL when the submission queue
+ * is full.  The entry is handed to the kernel by the next uring_submit().
+ */
+struct io_uring_sqe *
+uring_get_sqe(struct uring *ring)
+{
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+
+	if (ring->sqe_tail - head >= ring->sq_entries)
+		return NULL;
+	sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+	ring->sqe_tail++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+void
+uring_prep_writev(struct io_uring_sqe *sqe, int fd, const struct iovec *iov,
+		  unsigned int nr, off_t offset, void *user_data)
+{
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)iov;
+	sqe->len = nr;
+	sqe->off = offset;
+	sqe->user_data = (uintptr_t)user_data;
+}
+
+/*
+ * Submit all queued submission queue entries with a single system call.  Does
+ * nothing when there is nothing to submit.
+ */
+int
+uring_submit(struct uring *ring)
+{
+	unsigned int to_submit;
+	int ret;
+
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	for (;;) {
+		to_submit = ring->sqe_tail -
+			    __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (!to_submit)
+			return 0;
+		ret = io_uring_enter(ring->fd, to_submit, 0, 0);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			/*
+			 * The completion queue is full or the kernel is out
+			 * of memory; the entries remain queued until the next
+			 * attempt.
+			 */
+			if (errno == EBUSY || errno == EAGAIN)
+				return 0;
+			return -1;
+		}
+		if (ret == 0)
+			return 0;
+	}
+}
+
+/*
+ * Get the next completion queue entry, or NULL when there are no completions.
+ * The entry must be released with uring_cqe_seen().
+ */
+struct io_uring_cqe *
+uring_peek_cqe(struct uring *ring)
+{
+	unsigned int head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		/*
+		 * Completions that didn't fit into the completion queue are
+		 * kept in the kernel, and they don't make the ring file
+		 * descriptor readable until they are flushed.
+		 */
+		if (!(__atomic_load_n(ring->sq_flags, __ATOMIC_ACQUIRE) &
+		      IORING_SQ_CQ_OVERFLOW))
+			return NULL;
+		if (io_uring_enter(ring->fd, 0, 0, IORING_ENTER_GETEVENTS) == -1)
+			return NULL;
+		if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+			return NULL;
+	}
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+void
+uring_cqe_seen(struct uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
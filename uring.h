@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2026  FakeDLM contributors
+ *
+ * This file is part of FakeDLM, which is distributed under the terms of the
+ * GNU General Public License, version 3 or later; see COPYING.
+ */
+
+#ifndef __URING_H
+#define __URING_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+
+/*
+ * A minimal io_uring instance: a submission queue and a completion queue
+ * shared with the kernel.
+ */
+struct uring {
+	int fd;
+
+	unsigned int *sq_head, *sq_tail, *sq_flags;
+	unsigned int sq_mask, sq_entries;
+	unsigned int sqe_tail;
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cq_head, *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+};
+
+extern int uring_init(struct uring *ring, unsigned int entries);
+extern void uring_exit(struct uring *ring);
+extern struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+extern void uring_prep_writev(struct io_uring_sqe *sqe, int fd,
+			      const struct iovec *iov, unsigned int nr,
+			      off_t offset, void *user_data);
+extern int uring_submit(struct uring *ring);
+extern struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+extern void uring_cqe_seen(struct uring *ring);
+
+#endif  /* __URING_H */